@@ -0,0 +1,107 @@
+#include"virt_disk.h"
+#include<string.h>
+#include<pthread.h>
+
+typedef struct CacheSlot {
+  u32 block;               // disk block held in this slot 
+  u8 valid;
+  u8 ref;                  // clock reference bit 
+  u8 data[BLOCK_SIZE];
+} CacheSlot;
+
+static CacheSlot slots[BCACHE_SLOTS];
+static uint16_t slot_of[TOTAL_BLOCKS];   // slot index + 1, 0 when not cached 
+static u32 write_gen[TOTAL_BLOCKS];      // bumped on every write of the block 
+static u32 clock_hand;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//clock eviction, caller holds cache_lock
+static CacheSlot* grab_slot(u32 block_idx) {
+  for (;;) {
+    CacheSlot *s = &slots[clock_hand];
+    u32 idx = clock_hand;
+    clock_hand = (clock_hand + 1) % BCACHE_SLOTS;
+    if (s->valid && s->ref) { s->ref = 0; continue; }
+    if (s->valid) slot_of[s->block] = 0;
+    s->block = block_idx;
+    s->valid = 1;
+    s->ref = 1;
+    slot_of[block_idx] = (uint16_t)(idx + 1);
+    return s;
+  }
+}
+
+int bcache_get(u32 block_idx, void *buf) {
+  if (block_idx >= TOTAL_BLOCKS) return 0;
+  pthread_mutex_lock(&cache_lock);
+  u32 s = slot_of[block_idx];
+  if (s) {
+    slots[s-1].ref = 1;
+    memcpy(buf, slots[s-1].data, BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return s != 0;
+}
+
+void bcache_put(u32 block_idx, const void *buf) {
+  if (block_idx >= TOTAL_BLOCKS) return;
+  pthread_mutex_lock(&cache_lock);
+  write_gen[block_idx]++;
+  u32 s = slot_of[block_idx];
+  CacheSlot *slot = s ? &slots[s-1] : grab_slot(block_idx);
+  slot->ref = 1;
+  memcpy(slot->data, buf, BLOCK_SIZE);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+u32 bcache_write_gen(u32 block_idx) {
+  if (block_idx >= TOTAL_BLOCKS) return 0;
+  pthread_mutex_lock(&cache_lock);
+  u32 g = write_gen[block_idx];
+  pthread_mutex_unlock(&cache_lock);
+  return g;
+}
+
+//insert data read from disk, dropped if the block was written since gen was taken
+int bcache_fill(u32 block_idx, const void *buf, u32 gen) {
+  if (block_idx >= TOTAL_BLOCKS) return 0;
+  int filled = 0;
+  pthread_mutex_lock(&cache_lock);
+  if (!slot_of[block_idx] && write_gen[block_idx] == gen) {
+    CacheSlot *slot = grab_slot(block_idx);
+    memcpy(slot->data, buf, BLOCK_SIZE);
+    filled = 1;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return filled;
+}
+
+int bcache_contains(u32 block_idx) {
+  if (block_idx >= TOTAL_BLOCKS) return 0;
+  pthread_mutex_lock(&cache_lock);
+  int r = slot_of[block_idx] != 0;
+  pthread_mutex_unlock(&cache_lock);
+  return r;
+}
+
+//forget a block that is about to be written behind the cache's back
+void bcache_drop(u32 block_idx) {
+  if (block_idx >= TOTAL_BLOCKS) return;
+  pthread_mutex_lock(&cache_lock);
+  write_gen[block_idx]++;
+  u32 s = slot_of[block_idx];
+  if (s) {
+    slots[s-1].valid = 0;
+    slot_of[block_idx] = 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void bcache_reset(void) {
+  pthread_mutex_lock(&cache_lock);
+  memset(slot_of, 0, sizeof(slot_of));
+  for (u32 i = 0; i < BCACHE_SLOTS; i++) slots[i].valid = 0;
+  for (u32 i = 0; i < TOTAL_BLOCKS; i++) write_gen[i]++;
+  clock_hand = 0;
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,308 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<fcntl.h>
+
+// microbenchmarks for the core primitives. every run formats a scratch image in its
+// own temp directory, so a real virtual_disk.img is never touched. results go to
+// stdout as csv, one row per benchmark and parameter:
+//   bench,param,value,samples,median_ns,p99_ns
+// the rng is seeded with a fixed value so runs are comparable across builds
+
+#define BENCH_DEFAULT_REPS 2000
+#define BENCH_SEED 12345
+
+static u64 *samples;
+static usize reps = BENCH_DEFAULT_REPS;
+static const char *only; // run just the benchmarks whose name starts with this
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  u64 x = *(const u64 *)a, y = *(const u64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, const char *param, u32 value, usize n) {
+  if (n == 0) return;
+  qsort(samples, n, sizeof(u64), cmp_u64);
+  usize p99 = (n * 99) / 100;
+  if (p99 >= n) p99 = n - 1;
+  printf("%s,%s,%u,%zu,%llu,%llu\n", name, param, value, n,
+         (unsigned long long)samples[n / 2], (unsigned long long)samples[p99]);
+  fflush(stdout);
+}
+
+static int wanted(const char *name) {
+  return !only || strncmp(name, only, strlen(only)) == 0;
+}
+
+static int fresh_fs(void) {
+  //format_fs prints its layout, keep that out of the csv
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  if (saved >= 0 && devnull >= 0) dup2(devnull, STDOUT_FILENO);
+  int r = format_fs();
+  fflush(stdout);
+  if (saved >= 0) { dup2(saved, STDOUT_FILENO); close(saved); }
+  if (devnull >= 0) close(devnull);
+  if (r < 0 || load_fs() < 0) {
+    fprintf(stderr, "bench: cannot format scratch image\n");
+    return -1;
+  }
+  srand(BENCH_SEED);
+  return 0;
+}
+
+static u32 data_blocks(void) {
+  return sb.total_blocks - sb.data_block_start;
+}
+
+//allocate blocks until pct percent of the data area is used. the holes are spread
+//randomly so the first free block is not always right after the filled prefix
+static void fill_blocks(u32 pct) {
+  u32 want = (u32)((u64)data_blocks() * pct / 100);
+  u32 used = 0;
+  while (used < want) {
+    u32 b = sb.data_block_start + (u32)(rand() % data_blocks());
+    if (test_bitmap(b)) continue;
+    set_bitmap(b);
+    sb.free_blocks--;
+    used++;
+  }
+}
+
+static void fill_inodes(u32 pct) {
+  u32 want = (u32)((u64)(MAX_INODES - 1) * pct / 100);
+  u32 used = 0;
+  while (used < want) {
+    u32 ino = 1 + (u32)(rand() % (MAX_INODES - 1));
+    if (inode_table[ino].used) continue;
+    inode_table[ino].used = 1;
+    sb.free_inodes--;
+    used++;
+  }
+}
+
+//allocators run with metadata writes deferred so only the search is measured
+static void bench_allocate_block(u32 pct) {
+  if (fresh_fs() < 0) return;
+  fill_blocks(pct);
+  fs_defer_sync(1);
+  usize n = 0;
+  for (usize i = 0; i < reps; i++) {
+    u64 t = now_ns();
+    u32 b = allocate_block();
+    samples[n] = now_ns() - t;
+    if (!b) break;
+    n++;
+    free_block(b);
+  }
+  fs_defer_sync(0);
+  report("allocate_block", "fill_pct", pct, n);
+}
+
+static void bench_allocate_inode(u32 pct) {
+  if (fresh_fs() < 0) return;
+  fill_inodes(pct);
+  fs_defer_sync(1);
+  usize n = 0;
+  for (usize i = 0; i < reps; i++) {
+    u64 t = now_ns();
+    int ino = allocate_inode();
+    samples[n] = now_ns() - t;
+    if (ino < 0) break;
+    n++;
+    free_inode((u32)ino);
+  }
+  fs_defer_sync(0);
+  report("allocate_inode", "fill_pct", pct, n);
+}
+
+//make /d with count files named f0..f<count-1>, returns the dir inode or -1
+static int make_dir_of(u32 count) {
+  if (fs_create_dir("/d") < 0) return -1;
+  char path[32];
+  for (u32 i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "/d/f%u", i);
+    if (fs_create_file(path) < 0) return -1;
+  }
+  int d = (int)dir_lookup(&inode_table[0], "d");
+  return d ? d : -1;
+}
+
+static void bench_dir_lookup(u32 count) {
+  if (fresh_fs() < 0) return;
+  fs_defer_sync(1);
+  int d = make_dir_of(count);
+  if (d < 0) { fs_defer_sync(0); return; }
+  char name[MAX_FILENAME];
+  usize n = 0;
+  for (usize i = 0; i < reps; i++) {
+    snprintf(name, sizeof(name), "f%u", (u32)(rand() % count));
+    u64 t = now_ns();
+    u32 ino = dir_lookup(&inode_table[d], name);
+    samples[n] = now_ns() - t;
+    if (!ino) { fprintf(stderr, "bench: lookup of %s failed\n", name); break; }
+    n++;
+  }
+  fs_defer_sync(0);
+  report("dir_lookup", "dir_entries", count, n);
+}
+
+//time adding one entry to a directory that already holds count, then take it out again
+static void bench_dir_add_entry(u32 count) {
+  if (fresh_fs() < 0) return;
+  fs_defer_sync(1);
+  int d = make_dir_of(count);
+  if (d < 0) { fs_defer_sync(0); return; }
+  usize n = 0;
+  for (usize i = 0; i < reps; i++) {
+    u64 t = now_ns();
+    int r = dir_add_entry(&inode_table[d], "bench_entry", 1);
+    samples[n] = now_ns() - t;
+    if (r < 0) break;
+    n++;
+    dir_remove_entry(&inode_table[d], "bench_entry");
+  }
+  fs_defer_sync(0);
+  report("dir_add_entry", "dir_entries", count, n);
+}
+
+static void bench_resolve_path(u32 depth) {
+  if (fresh_fs() < 0) return;
+  fs_defer_sync(1);
+  char path[FS_PATH_MAX] = "";
+  usize len = 0;
+  for (u32 i = 0; i < depth; i++) {
+    len += snprintf(path + len, sizeof(path) - len, "/l%u", i);
+    if (fs_create_dir(path) < 0) { fs_defer_sync(0); return; }
+  }
+  u32 parent, target;
+  char name[MAX_FILENAME];
+  usize n = 0;
+  for (usize i = 0; i < reps; i++) {
+    u64 t = now_ns();
+    int r = resolve_path(path + 1, 1, &parent, name, &target);
+    samples[n] = now_ns() - t;
+    if (r < 0 || !target) { fprintf(stderr, "bench: resolve failed at depth %u\n", depth); break; }
+    n++;
+  }
+  fs_defer_sync(0);
+  report("resolve_path", "depth", depth, n);
+}
+
+//random blocks over the whole data area, most miss the buffer cache
+static void bench_block_io(void) {
+  if (fresh_fs() < 0) return;
+  u8 buf[BLOCK_SIZE];
+  memset(buf, 0xab, sizeof(buf));
+  if (wanted("write_block")) {
+    for (usize i = 0; i < reps; i++) {
+      u32 b = sb.data_block_start + (u32)(rand() % data_blocks());
+      u64 t = now_ns();
+      write_block(b, buf);
+      samples[i] = now_ns() - t;
+    }
+    report("write_block", "random", data_blocks(), reps);
+  }
+  if (wanted("read_block")) {
+    for (usize i = 0; i < reps; i++) {
+      u32 b = sb.data_block_start + (u32)(rand() % data_blocks());
+      u64 t = now_ns();
+      read_block(b, buf);
+      samples[i] = now_ns() - t;
+    }
+    report("read_block", "random", data_blocks(), reps);
+    for (usize i = 0; i < reps; i++) {
+      u64 t = now_ns();
+      read_block(sb.data_block_start, buf);
+      samples[i] = now_ns() - t;
+    }
+    report("read_block", "hot", 1, reps);
+  }
+}
+
+//whole file rewrite and read back, metadata is committed on every write as usual
+static void bench_file_io(u32 size) {
+  if (fresh_fs() < 0) return;
+  if (fs_create_file("/bench_file") < 0) return;
+  u8 *buf = malloc(size);
+  if (!buf) return;
+  for (u32 i = 0; i < size; i++) buf[i] = (u8)rand();
+  if (wanted("fs_write_file")) {
+    usize n = 0;
+    for (usize i = 0; i < reps; i++) {
+      u64 t = now_ns();
+      ssize w = fs_write_file("/bench_file", buf, size);
+      samples[n] = now_ns() - t;
+      if (w != (ssize)size) break;
+      n++;
+    }
+    report("fs_write_file", "bytes", size, n);
+  } else {
+    fs_write_file("/bench_file", buf, size);
+  }
+  if (wanted("fs_read_file")) {
+    usize n = 0;
+    for (usize i = 0; i < reps; i++) {
+      u64 t = now_ns();
+      ssize r = fs_read_file("/bench_file", buf, size);
+      samples[n] = now_ns() - t;
+      if (r != (ssize)size) break;
+      n++;
+    }
+    report("fs_read_file", "bytes", size, n);
+  }
+  free(buf);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n reps] [-b name_prefix]\n", prog);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) reps = (usize)atol(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) only = argv[++i];
+    else { usage(argv[0]); return 1; }
+  }
+  if (reps == 0) { usage(argv[0]); return 1; }
+  samples = malloc(sizeof(u64) * reps);
+  if (!samples) return 1;
+
+  char dir[] = "/tmp/vdisk_bench.XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) < 0) { perror("bench: scratch dir"); return 1; }
+
+  static const u32 fills[] = { 0, 50, 90, 99 };
+  static const u32 dir_sizes[] = { 8, 64, 256 };
+  static const u32 depths[] = { 1, 4, 16, 64 };
+  static const u32 file_sizes[] = { 1024, 4096, BLOCK_SIZE * DIRECT_PTRS };
+  const usize nf = sizeof(fills) / sizeof(fills[0]);
+  const usize nd = sizeof(dir_sizes) / sizeof(dir_sizes[0]);
+  const usize np = sizeof(depths) / sizeof(depths[0]);
+  const usize ns = sizeof(file_sizes) / sizeof(file_sizes[0]);
+
+  printf("bench,param,value,samples,median_ns,p99_ns\n");
+  for (usize i = 0; i < nf; i++) if (wanted("allocate_block")) bench_allocate_block(fills[i]);
+  for (usize i = 0; i < nf; i++) if (wanted("allocate_inode")) bench_allocate_inode(fills[i]);
+  for (usize i = 0; i < nd; i++) if (wanted("dir_lookup")) bench_dir_lookup(dir_sizes[i]);
+  for (usize i = 0; i < nd; i++) if (wanted("dir_add_entry")) bench_dir_add_entry(dir_sizes[i]);
+  for (usize i = 0; i < np; i++) if (wanted("resolve_path")) bench_resolve_path(depths[i]);
+  if (wanted("write_block") || wanted("read_block")) bench_block_io();
+  for (usize i = 0; i < ns; i++) {
+    if (wanted("fs_write_file") || wanted("fs_read_file")) bench_file_io(file_sizes[i]);
+  }
+
+  unlink(DISK_PATH);
+  if (chdir("/") == 0) rmdir(dir);
+  free(samples);
+  return 0;
+}
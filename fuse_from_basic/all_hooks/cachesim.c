@@ -0,0 +1,324 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+// buffer cache simulator. reads the block accesses from a trace recorded with
+// fuse_mount --trace=<file> --trace-blocks and replays them through LRU, CLOCK, ARC
+// and 2Q at a range of cache sizes. the real cache is write-through and keeps written
+// blocks, so a write is an access that makes the block resident but never saves i/o.
+// one csv row per policy and size:
+//   policy,cache_blocks,accesses,hit_ratio,reads,read_hits,read_hit_ratio,bytes_saved
+
+#define NIL 0xffffffffu
+
+typedef struct Access {
+  u32 block;
+  u8 is_write;
+} Access;
+
+typedef struct SimResult {
+  u64 hits;
+  u64 read_hits;
+} SimResult;
+
+// ---- intrusive lists over block numbers, a block sits on at most one list ----
+
+enum { L_NONE, L_T1, L_T2, L_B1, L_B2 }; // ARC lists, 2Q reuses them as A1in, Am, A1out
+
+typedef struct List {
+  u32 head;   // most recent
+  u32 tail;   // least recent
+  u32 size;
+} List;
+
+static u32 *nxt, *prv;
+static u8 *where;
+static u32 nblocks; // highest block in the trace + 1
+
+static void list_init(List *l) {
+  l->head = l->tail = NIL;
+  l->size = 0;
+}
+
+static void list_push(List *l, u32 b, u8 tag) {
+  prv[b] = NIL;
+  nxt[b] = l->head;
+  if (l->head != NIL) prv[l->head] = b;
+  l->head = b;
+  if (l->tail == NIL) l->tail = b;
+  l->size++;
+  where[b] = tag;
+}
+
+static void list_remove(List *l, u32 b) {
+  if (prv[b] != NIL) nxt[prv[b]] = nxt[b]; else l->head = nxt[b];
+  if (nxt[b] != NIL) prv[nxt[b]] = prv[b]; else l->tail = prv[b];
+  l->size--;
+  where[b] = L_NONE;
+}
+
+static u32 list_pop_tail(List *l) {
+  u32 b = l->tail;
+  if (b != NIL) list_remove(l, b);
+  return b;
+}
+
+static void reset_blocks(void) {
+  memset(where, L_NONE, nblocks);
+}
+
+static void count_hit(SimResult *r, const Access *a) {
+  r->hits++;
+  if (!a->is_write) r->read_hits++;
+}
+
+// ---- policies ----
+
+static SimResult sim_lru(const Access *acc, usize n, u32 size) {
+  SimResult r = { 0, 0 };
+  List l;
+  list_init(&l);
+  reset_blocks();
+  for (usize i = 0; i < n; i++) {
+    u32 b = acc[i].block;
+    if (where[b] == L_T1) {
+      count_hit(&r, &acc[i]);
+      list_remove(&l, b);
+    } else if (l.size >= size) {
+      list_pop_tail(&l);
+    }
+    list_push(&l, b, L_T1);
+  }
+  return r;
+}
+
+//same second chance scheme as bcache.c, new blocks start with the bit set
+static SimResult sim_clock(const Access *acc, usize n, u32 size) {
+  SimResult r = { 0, 0 };
+  u32 *slot_block = malloc(sizeof(u32) * size);
+  u8 *ref = calloc(size, 1);
+  u32 *slot_of = malloc(sizeof(u32) * nblocks);
+  if (!slot_block || !ref || !slot_of) { free(slot_block); free(ref); free(slot_of); return r; }
+  for (u32 s = 0; s < size; s++) slot_block[s] = NIL;
+  for (u32 b = 0; b < nblocks; b++) slot_of[b] = NIL;
+  u32 hand = 0;
+  for (usize i = 0; i < n; i++) {
+    u32 b = acc[i].block;
+    if (slot_of[b] != NIL) {
+      count_hit(&r, &acc[i]);
+      ref[slot_of[b]] = 1;
+      continue;
+    }
+    while (slot_block[hand] != NIL && ref[hand]) {
+      ref[hand] = 0;
+      hand = (hand + 1) % size;
+    }
+    if (slot_block[hand] != NIL) slot_of[slot_block[hand]] = NIL;
+    slot_block[hand] = b;
+    ref[hand] = 1;
+    slot_of[b] = hand;
+    hand = (hand + 1) % size;
+  }
+  free(slot_block);
+  free(ref);
+  free(slot_of);
+  return r;
+}
+
+//2Q full version: A1in fifo for first touches (a quarter of the cache), A1out ghost
+//list of recently evicted first touches (half the cache) and Am lru for re-references
+static SimResult sim_2q(const Access *acc, usize n, u32 size) {
+  SimResult r = { 0, 0 };
+  List a1in, am, a1out;
+  list_init(&a1in); list_init(&am); list_init(&a1out);
+  reset_blocks();
+  u32 kin = size / 4 ? size / 4 : 1, kout = size / 2 ? size / 2 : 1;
+  for (usize i = 0; i < n; i++) {
+    u32 b = acc[i].block;
+    if (where[b] == L_T2) { //Am
+      count_hit(&r, &acc[i]);
+      list_remove(&am, b);
+      list_push(&am, b, L_T2);
+      continue;
+    }
+    if (where[b] == L_T1) { //A1in, stays put
+      count_hit(&r, &acc[i]);
+      continue;
+    }
+    if (a1in.size + am.size >= size) {
+      if (a1in.size > kin || am.size == 0) {
+        u32 v = list_pop_tail(&a1in);
+        list_push(&a1out, v, L_B1);
+        if (a1out.size > kout) list_pop_tail(&a1out);
+      } else {
+        list_pop_tail(&am);
+      }
+    }
+    if (where[b] == L_B1) {
+      list_remove(&a1out, b);
+      list_push(&am, b, L_T2);
+    } else {
+      list_push(&a1in, b, L_T1);
+    }
+  }
+  return r;
+}
+
+//ARC as in Megiddo and Modha, p is the adaptive target size of T1
+static void arc_replace(List *t1, List *t2, List *b1, List *b2, u32 p, int in_b2) {
+  if (t1->size > 0 && (t1->size > p || (in_b2 && t1->size == p) || t2->size == 0)) {
+    u32 v = list_pop_tail(t1);
+    list_push(b1, v, L_B1);
+  } else {
+    u32 v = list_pop_tail(t2);
+    if (v != NIL) list_push(b2, v, L_B2);
+  }
+}
+
+static SimResult sim_arc(const Access *acc, usize n, u32 size) {
+  SimResult r = { 0, 0 };
+  List t1, t2, b1, b2;
+  list_init(&t1); list_init(&t2); list_init(&b1); list_init(&b2);
+  reset_blocks();
+  u32 p = 0;
+  for (usize i = 0; i < n; i++) {
+    u32 b = acc[i].block;
+    u8 w = where[b];
+    if (w == L_T1 || w == L_T2) {
+      count_hit(&r, &acc[i]);
+      list_remove(w == L_T1 ? &t1 : &t2, b);
+      list_push(&t2, b, L_T2);
+      continue;
+    }
+    if (w == L_B1) {
+      u32 d = b2.size / b1.size > 1 ? b2.size / b1.size : 1;
+      p = p + d < size ? p + d : size;
+      arc_replace(&t1, &t2, &b1, &b2, p, 0);
+      list_remove(&b1, b);
+      list_push(&t2, b, L_T2);
+      continue;
+    }
+    if (w == L_B2) {
+      u32 d = b1.size / b2.size > 1 ? b1.size / b2.size : 1;
+      p = p > d ? p - d : 0;
+      arc_replace(&t1, &t2, &b1, &b2, p, 1);
+      list_remove(&b2, b);
+      list_push(&t2, b, L_T2);
+      continue;
+    }
+    u32 l1 = t1.size + b1.size, total = l1 + t2.size + b2.size;
+    if (l1 >= size) {
+      if (t1.size < size) {
+        list_pop_tail(&b1);
+        arc_replace(&t1, &t2, &b1, &b2, p, 0);
+      } else {
+        list_pop_tail(&t1);
+      }
+    } else if (total >= size) {
+      if (total >= 2 * size) list_pop_tail(&b2);
+      arc_replace(&t1, &t2, &b1, &b2, p, 0);
+    }
+    list_push(&t1, b, L_T1);
+  }
+  return r;
+}
+
+typedef struct Policy {
+  const char *name;
+  SimResult (*run)(const Access *acc, usize n, u32 size);
+} Policy;
+
+static const Policy policies[] = {
+  { "lru", sim_lru }, { "clock", sim_clock }, { "arc", sim_arc }, { "2q", sim_2q },
+};
+
+// ---- driver ----
+
+static Access* load_accesses(const char *trace, usize *out_n) {
+  FILE *f = trace_read_open(trace);
+  if (!f) { fprintf(stderr, "cachesim: '%s' is not a trace file\n", trace); return NULL; }
+  static char path[TRACE_MAX_PATH + 1], path2[TRACE_MAX_PATH + 1];
+  usize cap = 4096, n = 0;
+  Access *acc = malloc(sizeof(Access) * cap);
+  TraceRec r;
+  int rc = 0;
+  while (acc && (rc = trace_next(f, &r, path, path2)) == 1) {
+    if (r.op != TR_BLOCK_READ && r.op != TR_BLOCK_WRITE) continue;
+    if (r.off >= NIL) continue;
+    if (n == cap) {
+      Access *g = realloc(acc, sizeof(Access) * cap * 2);
+      if (!g) { free(acc); acc = NULL; break; }
+      acc = g;
+      cap *= 2;
+    }
+    acc[n].block = (u32)r.off;
+    acc[n].is_write = r.op == TR_BLOCK_WRITE;
+    if (acc[n].block + 1 > nblocks) nblocks = acc[n].block + 1;
+    n++;
+  }
+  fclose(f);
+  if (acc && rc < 0) fprintf(stderr, "cachesim: trace is truncated or corrupt, using what was read\n");
+  *out_n = n;
+  return acc;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s size,size,...] [-p policy,...] <trace>\n"
+                  "  sizes are in blocks (default powers of two from 16 to %u), policies lru,clock,arc,2q\n",
+          prog, TOTAL_BLOCKS);
+}
+
+int main(int argc, char **argv) {
+  const char *trace = NULL, *sizes_arg = NULL, *policy_arg = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) sizes_arg = argv[++i];
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) policy_arg = argv[++i];
+    else if (!trace && argv[i][0] != '-') trace = argv[i];
+    else { usage(argv[0]); return 1; }
+  }
+  if (!trace) { usage(argv[0]); return 1; }
+
+  u32 sizes[64];
+  usize nsizes = 0;
+  if (sizes_arg) {
+    char *copy = strdup(sizes_arg), *save = NULL;
+    for (char *t = strtok_r(copy, ",", &save); t && nsizes < 64; t = strtok_r(NULL, ",", &save)) {
+      u32 v = (u32)strtoul(t, NULL, 10);
+      if (v) sizes[nsizes++] = v;
+    }
+    free(copy);
+  } else {
+    for (u32 v = 16; v <= TOTAL_BLOCKS; v *= 2) sizes[nsizes++] = v;
+  }
+  if (!nsizes) { usage(argv[0]); return 1; }
+
+  usize n;
+  Access *acc = load_accesses(trace, &n);
+  if (!acc) return 1;
+  if (!n) { fprintf(stderr, "cachesim: no block records, record with --trace-blocks\n"); free(acc); return 1; }
+  u64 reads = 0;
+  for (usize i = 0; i < n; i++) reads += !acc[i].is_write;
+
+  nxt = malloc(sizeof(u32) * nblocks);
+  prv = malloc(sizeof(u32) * nblocks);
+  where = malloc(nblocks);
+  if (!nxt || !prv || !where) return 1;
+
+  printf("policy,cache_blocks,accesses,hit_ratio,reads,read_hits,read_hit_ratio,bytes_saved\n");
+  for (usize p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+    if (policy_arg && !strstr(policy_arg, policies[p].name)) continue;
+    for (usize s = 0; s < nsizes; s++) {
+      SimResult r = policies[p].run(acc, n, sizes[s]);
+      printf("%s,%u,%zu,%.4f,%llu,%llu,%.4f,%llu\n", policies[p].name, sizes[s], n,
+             (double)r.hits / n, (unsigned long long)reads, (unsigned long long)r.read_hits,
+             reads ? (double)r.read_hits / reads : 0.0,
+             (unsigned long long)r.read_hits * BLOCK_SIZE);
+    }
+  }
+  free(nxt);
+  free(prv);
+  free(where);
+  free(acc);
+  return 0;
+}
@@ -5,33 +5,46 @@
 #include<string.h>
 #include<stdbool.h>
 
-//return total subdirectory/files count and DirEntry adress
-DirEntry* read_dir_entries(Inode *dir, usize *out_count) {
-    if (!dir->is_dir) { *out_count = 0; return NULL; }
-    usize cap = 8; //initially size for arrary
+//read the live entries of dir into *buf, growing it as needed, so a walker can reuse
+//one buffer for every directory. returns the entry count, -1 if the buffer cannot grow
+ssize read_dir_entries_into(Inode *dir, DirEntry **buf, usize *cap) {
+    if (!dir->is_dir) return 0;
     usize cnt = 0;
-    DirEntry *arr = malloc(sizeof(DirEntry) * cap);
-    u8 buf[BLOCK_SIZE];
+    u8 blk[BLOCK_SIZE];
     u32 remaining = dir->size;//only search dir->size bytes
     for (int i = 0; i < DIRECT_PTRS && remaining > 0; i++) {
         if (!dir->direct[i]) continue; // skip if not used
-        usize r = read_block(dir->direct[i], buf); //else read block
+        int cat = io_set_category(IO_CAT_DIR);
+        usize r = read_block(dir->direct[i], blk); //else read block
+        io_set_category(cat);
         if (r <= 0) break; // if block is empty stop reading failed or its empty
         usize per = BLOCK_SIZE / sizeof(DirEntry);
-        DirEntry *entries = (DirEntry*)buf;
+        DirEntry *entries = (DirEntry*)blk;
         for (usize j = 0; j < per && remaining > 0; j++) {
-            if (entries[j].inode_id == 0) {
-		    remaining -= sizeof(DirEntry);
-		    continue;
-	    }
-            if (cnt >= cap) { cap *= 2;//if sized limit exceed allocate more space
-		    arr = realloc(arr, sizeof(DirEntry) * cap);
-	    }
-            arr[cnt++] = entries[j];
             remaining -= sizeof(DirEntry);
+            if (entries[j].inode_id == 0) continue;
+            if (cnt >= *cap) { //if sized limit exceed allocate more space
+                usize ncap = *cap ? *cap * 2 : 8;
+                DirEntry *n = realloc(*buf, sizeof(DirEntry) * ncap);
+                if (!n) return -1;
+                *buf = n;
+                *cap = ncap;
+            }
+            (*buf)[cnt++] = entries[j];
         }
     }
-    *out_count = cnt;
+    return (ssize)cnt;
+}
+
+//return total subdirectory/files count and DirEntry adress
+DirEntry* read_dir_entries(Inode *dir, usize *out_count) {
+    *out_count = 0;
+    if (!dir->is_dir) return NULL;
+    usize cap = 8; //initially size for arrary
+    DirEntry *arr = malloc(sizeof(DirEntry) * cap);
+    if (!arr) return NULL;
+    ssize cnt = read_dir_entries_into(dir, &arr, &cap);
+    if (cnt > 0) *out_count = (usize)cnt;
     return arr;
 }
 
@@ -52,9 +65,8 @@ int write_dir_entries(Inode *dir, DirEntry *entries, usize count) {
     // clear previous content of other blocks 
     for (usize i = needed_blocks; i < DIRECT_PTRS; i++) {
         if (dir->direct[i]) {
-	       	clear_bitmap(dir->direct[i]);
+	       	free_block(dir->direct[i]);
 	       	dir->direct[i]=0;
-	       	sb.free_blocks++;
        	}
     }
 
@@ -66,7 +78,9 @@ int write_dir_entries(Inode *dir, DirEntry *entries, usize count) {
         usize remain = total_bytes - written;
         if (remain < BLOCK_SIZE) tocopy = remain;
         memcpy(block_buf, ((u8*)entries)+written, tocopy);
+        int cat = io_set_category(IO_CAT_DIR);
         write_block(dir->direct[i], block_buf);
+        io_set_category(cat);
         written += tocopy;
     }
     dir->size = total_bytes;
@@ -146,7 +160,7 @@ void free_tokens(char **parts, int cnt) {
     free(parts);
 }
 
-int resolve_path(const char *path, int want_target, u32 *out_parent, char *out_name, u32 *out_target) {
+static int resolve_path_walk(const char *path, int want_target, u32 *out_parent, char *out_name, u32 *out_target) {
     if (strcmp(path, "/") == 0) {
         *out_parent = 0;
         strcpy(out_name, "/");
@@ -172,3 +186,10 @@ int resolve_path(const char *path, int want_target, u32 *out_parent, char *out_n
     free_tokens(parts,cnt);
     return 0;
 }
+
+int resolve_path(const char *path, int want_target, u32 *out_parent, char *out_name, u32 *out_target) {
+    u64 t0 = stats_now();
+    int r = resolve_path_walk(path, want_target, out_parent, out_name, out_target);
+    stats_record(ST_RESOLVE_PATH, t0);
+    return r;
+}
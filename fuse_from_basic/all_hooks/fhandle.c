@@ -0,0 +1,121 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+
+//copy the inode block pointers into the handle if they changed since last time
+static void fh_refresh_map(FileHandle *fh) {
+  if (fh->map_gen == inode_gen[fh->ino]) return;
+  memcpy(fh->map, inode_table[fh->ino].direct, sizeof(fh->map));
+  fh->map_gen = inode_gen[fh->ino];
+}
+
+//the inode was freed (and maybe reused) since this handle was opened
+static int fh_stale(FileHandle *fh) {
+  return !inode_table[fh->ino].used || inode_epoch[fh->ino] != fh->epoch;
+}
+
+//remember where this access ended so the next one can be classified
+static void fh_track_access(FileHandle *fh, off_t off, usize len) {
+  if (off == fh->next_off) fh->seq_count++;
+  else fh->seq_count = 0;
+  fh->next_off = off + (off_t)len;
+}
+
+FileHandle* fh_open(u32 ino) {
+  if (ino >= MAX_INODES || !inode_table[ino].used) return NULL;
+  if (inode_table[ino].is_dir) return NULL;
+  FileHandle *fh = calloc(1, sizeof(FileHandle));
+  if (!fh) return NULL;
+  fh->ino = ino;
+  fh->epoch = inode_epoch[ino];
+  fh->map_gen = inode_gen[ino] - 1; //force the first refresh
+  fh_refresh_map(fh);
+  return fh;
+}
+
+ssize fh_read(FileHandle *fh, u8 *buf, usize len, off_t off) {
+  Inode *in = &inode_table[fh->ino];
+  if (fh_stale(fh)) return -ESTALE;
+  if (off < 0) return -1;
+  if ((u64)off >= in->size) return 0;
+  if (len > in->size - (u64)off) len = in->size - (u64)off;
+  fh_refresh_map(fh);
+
+  u8 blockbuf[BLOCK_SIZE];
+  usize done = 0;
+  while (done < len) {
+    u64 pos = (u64)off + done;
+    u32 bi = pos / BLOCK_SIZE;
+    u32 in_blk = pos % BLOCK_SIZE;
+    usize copy = BLOCK_SIZE - in_blk;
+    if (copy > len - done) copy = len - done;
+    if (bi >= DIRECT_PTRS) break;
+    if (!fh->map[bi]) memset(buf + done, 0, copy); //never written, reads as zeros
+    else {
+      if (read_block(fh->map[bi], blockbuf) != BLOCK_SIZE) return done ? (ssize)done : -1;
+      memcpy(buf + done, blockbuf + in_blk, copy);
+    }
+    done += copy;
+  }
+  fh_track_access(fh, off, done);
+  ra_on_read(fh);
+  return (ssize)done;
+}
+
+ssize fh_write(FileHandle *fh, const u8 *buf, usize len, off_t off) {
+  Inode *in = &inode_table[fh->ino];
+  if (fh_stale(fh)) return -ESTALE; //never map blocks into a freed or reused inode
+  if (off < 0) return -1;
+  if ((u64)off + len > (u64)DIRECT_PTRS * BLOCK_SIZE) return -1; //past the last direct pointer
+  fh_refresh_map(fh);
+
+  u8 blockbuf[BLOCK_SIZE];
+  usize done = 0;
+  while (done < len) {
+    u64 pos = (u64)off + done;
+    u32 bi = pos / BLOCK_SIZE;
+    u32 in_blk = pos % BLOCK_SIZE;
+    usize copy = BLOCK_SIZE - in_blk;
+    if (copy > len - done) copy = len - done;
+    if (!fh->map[bi]) {
+      u32 b = allocate_block();
+      if (!b) break; //disk full, report what made it
+      in->direct[bi] = b;
+      touch_inode(fh->ino);
+      fh->map[bi] = b;
+      fh->map_gen = inode_gen[fh->ino];
+      memset(blockbuf, 0, BLOCK_SIZE);
+    } else if (block_shared(fh->map[bi])) {
+      //block belongs to a clone too, give this inode its own copy first
+      if (copy < BLOCK_SIZE && read_block(fh->map[bi], blockbuf) != BLOCK_SIZE) break;
+      u32 b = allocate_block();
+      if (!b) break;
+      free_block(fh->map[bi]); //only drops our reference
+      in->direct[bi] = b;
+      touch_inode(fh->ino);
+      fh->map[bi] = b;
+      fh->map_gen = inode_gen[fh->ino];
+    } else if (copy < BLOCK_SIZE) {
+      //partial block, keep the bytes around it
+      if (read_block(fh->map[bi], blockbuf) != BLOCK_SIZE) break;
+    }
+    memcpy(blockbuf + in_blk, buf + done, copy);
+    if (write_block(fh->map[bi], blockbuf) != BLOCK_SIZE) break;
+    done += copy;
+  }
+  if ((u64)off + done > in->size) in->size = (u32)((u64)off + done);
+  fh_track_access(fh, off, done);
+  if (done == 0 && len > 0) return -1;
+  return (ssize)done;
+}
+
+int fh_flush(FileHandle *fh) {
+  (void) fh;
+  return sync_metadata();
+}
+
+void fh_close(FileHandle *fh) {
+  free(fh);
+}
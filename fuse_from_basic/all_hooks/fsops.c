@@ -1,3 +1,4 @@
+#define _GNU_SOURCE //memmem
 #include"virt_disk.h"
 #include<stdio.h>
 #include<unistd.h>
@@ -6,73 +7,107 @@
 #include<fcntl.h>
 #include<stdlib.h>
 #include<regex.h>
+#include<fnmatch.h>
 #include<stdbool.h>
 
-char* get_full_path(u32 ino) {
-  static char path_buffer[MAX_INODES+1];
-  char temp_name[MAX_FILENAME + 1];
-
-  if (ino == 0) {
-    strcpy(path_buffer, "/");
-    return path_buffer;
-  }
-  u32 temp_stack[MAX_INODES];
-  int stack_ptr = 0;
-  u32 current = ino;
-
-  while (current != 0 && current < MAX_INODES && inode_table[current].used) {
-    if (stack_ptr >= MAX_INODES) break;
-    temp_stack[stack_ptr++] = current;
-    current = inode_table[current].parent;
-    if (current == temp_stack[stack_ptr - 1] && current != 0) break;
-  }
-
-  if (current != 0) {
-    strcpy(path_buffer, "<Invalid Path>");
-    return path_buffer;
-  }
-
-  path_buffer[0] = '\0';
-  strcat(path_buffer, "/");
-
-  for (int i = stack_ptr - 1; i >= 0; i--) {
-    u32 id = temp_stack[i];
-    strncpy(temp_name, inode_table[id].name, MAX_FILENAME);
-    temp_name[MAX_FILENAME] = '\0';
-    strcat(path_buffer, temp_name);
+//save run as the best literal so far if it is longer
+static void keep_longest(const char *run, usize rl, char *out, usize *best) {
+  if (rl <= *best) return;
+  memcpy(out, run, rl);
+  out[rl] = '\0';
+  *best = rl;
+}
 
-    if (i > 0) {
-      strcat(path_buffer, "/");
+//longest run of plain characters that every match of the extended regex must contain.
+//used as a memmem prefilter before regexec, returns 0 when nothing is certain
+static usize regex_required_literal(const char *pat, char *out, usize cap) {
+  char run[MAX_FILENAME];
+  usize rl = 0, best = 0;
+  out[0] = '\0';
+  if (strchr(pat, '|')) return 0; //alternation, no single literal is required
+  const char *p = pat;
+  while (*p) {
+    char c = 0;
+    int lit = 0;
+    if (*p == '\\' && p[1]) {
+      if (strchr(".[]()*+?{}|^$\\/", p[1])) { c = p[1]; lit = 1; }
+      p += 2;
+    } else if (*p == '[') {
+      p++;
+      if (*p == '^') p++;
+      if (*p == ']') p++; //leading ] is part of the set
+      while (*p && *p != ']') p++;
+      if (*p) p++;
+    } else if (*p == '(') {
+      int depth = 0;
+      do {
+        if (*p == '\\' && p[1]) { p += 2; continue; }
+        if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        p++;
+      } while (*p && depth > 0);
+    } else if (*p == '{') {
+      while (*p && *p != '}') p++;
+      if (*p) p++;
+    } else if (strchr(".)*+?^$", *p)) {
+      p++;
+    } else {
+      c = *p++;
+      lit = 1;
+    }
+    if (lit && (*p == '*' || *p == '?' || *p == '{')) lit = 0; //may occur zero times
+    if (!lit) {
+      keep_longest(run, rl, out, &best);
+      rl = 0;
+      continue;
+    }
+    if (rl < sizeof(run) && rl + 1 < cap) run[rl++] = c;
+    if (*p == '+') { //repeated char, whatever follows is not adjacent to the run
+      keep_longest(run, rl, out, &best);
+      rl = 0;
     }
   }
-
-  if (strlen(path_buffer) == 0) {
-    strcpy(path_buffer, "/");
-  }
-
-  return path_buffer;
+  keep_longest(run, rl, out, &best);
+  return best;
 }
 
-static void find_paths_recursive(u32 ino, const regex_t *preg) {
-  Inode *in = &inode_table[ino];
+typedef int (*name_match_fn)(const char *name, const void *ctx);
 
-  if (regexec(preg, in->name, 0, NULL, 0) == 0) {
-    char *full_path = get_full_path(ino);
-    printf("Found: %s\n", full_path);
+//every inode already carries its own name, so find never reads directories. with the
+//trigram index only the candidate inodes for lit are visited, otherwise the table is
+//scanned once with lit as a memmem prefilter. paths are only built for hits
+static void find_matching(const char *lit, usize litlen, name_match_fn match, const void *ctx) {
+  u64 cand[MAX_INODES / 64];
+  int indexed = nameidx_candidates(lit, litlen, cand) == 0;
+  char *path = malloc(FS_PATH_MAX);
+  if (!path) return;
+  for (u32 ino = 0; ino < MAX_INODES; ino++) {
+    if (indexed) {
+      u64 word = cand[ino / 64] >> (ino % 64);
+      if (!word) { ino |= 63; continue; } //rest of this word is empty
+      if (!(word & 1)) continue;
+    }
+    Inode *in = &inode_table[ino];
+    if (!in->used) continue;
+    if (litlen && !memmem(in->name, strnlen(in->name, MAX_FILENAME), lit, litlen)) continue;
+    if (!match(in->name, ctx)) continue;
+    if (fs_path_of(ino, path, FS_PATH_MAX) < 0) continue; //orphan, not reachable from root
+    printf("Found: %s\n", path);
   }
+  free(path);
+}
 
-  if (!in->is_dir) return;
+static int match_regex(const char *name, const void *ctx) {
+  return regexec((const regex_t *)ctx, name, 0, NULL, 0) == 0;
+}
 
-  usize cnt;
-  DirEntry *arr = read_dir_entries(in, &cnt);
+static int match_glob(const char *name, const void *ctx) {
+  return fnmatch((const char *)ctx, name, 0) == 0;
+}
 
-  for (usize i = 0; i < cnt; i++) {
-    u32 child_ino = arr[i].inode_id;
-    if (child_ino > 0 && child_ino < MAX_INODES && inode_table[child_ino].used) {
-      find_paths_recursive(child_ino, preg);
-    }
-  }
-  free(arr);
+static int match_any(const char *name, const void *ctx) {
+  (void) name; (void) ctx;
+  return 1; //the literal prefilter already did the work
 }
 
 void fs_find_paths(const char *pattern) {
@@ -87,11 +122,63 @@ void fs_find_paths(const char *pattern) {
     return;
   }
 
-  find_paths_recursive(0, &regex);
+  char lit[MAX_FILENAME];
+  usize litlen = regex_required_literal(pattern, lit, sizeof(lit));
+  find_matching(lit, litlen, match_regex, &regex);
   regfree(&regex);
 }
 
-int fs_create_file(const char *path) {
+//longest run of non wildcard characters in a shell glob
+static usize glob_required_literal(const char *pat, char *out, usize cap) {
+  char run[MAX_FILENAME];
+  usize rl = 0, best = 0;
+  out[0] = '\0';
+  for (const char *p = pat; *p; ) {
+    if (*p == '*' || *p == '?') {
+      keep_longest(run, rl, out, &best); rl = 0; p++;
+    } else if (*p == '[') {
+      keep_longest(run, rl, out, &best); rl = 0;
+      p++;
+      if (*p == '!' || *p == '^') p++;
+      if (*p == ']') p++;
+      while (*p && *p != ']') p++;
+      if (*p) p++;
+    } else {
+      if (*p == '\\' && p[1]) p++;
+      if (rl < sizeof(run) && rl + 1 < cap) run[rl++] = *p;
+      p++;
+    }
+  }
+  keep_longest(run, rl, out, &best);
+  return best;
+}
+
+void fs_find_glob(const char *pattern) {
+  printf("Searching for names matching glob: '%s'\n", pattern);
+  char lit[MAX_FILENAME];
+  usize litlen = glob_required_literal(pattern, lit, sizeof(lit));
+  find_matching(lit, litlen, match_glob, pattern);
+}
+
+void fs_find_substring(const char *needle) {
+  printf("Searching for names containing: '%s'\n", needle);
+  usize len = strlen(needle);
+  if (len >= MAX_FILENAME) return; //can never fit in a name
+  find_matching(needle, len, match_any, NULL);
+}
+
+//every fs_* operation is one metadata commit. the do_* bodies and the allocators they
+//call only mark metadata dirty, op_end writes it unless an outer caller defers
+static int op_begin(void) {
+  return fs_defer_sync(1);
+}
+
+static int op_end(int was) {
+  fs_defer_sync(was);
+  return was ? 0 : fs_commit();
+}
+
+static int do_create_file(const char *path) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
 
@@ -105,6 +192,7 @@ int fs_create_file(const char *path) {
   strncpy(in->name, name, MAX_FILENAME-1);
   in->parent = parent;
   in->size = 0;
+  nameidx_add(ino);
   if (dir_add_entry(&inode_table[parent], name, ino) < 0) {
     free_inode(ino);
     return -1;
@@ -112,7 +200,16 @@ int fs_create_file(const char *path) {
   sync_metadata();
   return ino;
 }
-ssize fs_write_file(const char *path, const u8 *buf, usize len) {
+
+int fs_create_file(const char *path) {
+  FS_PROBE1(create__entry, path);
+  int was = op_begin();
+  int r = do_create_file(path);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(create__return, path, r);
+  return r;
+}
+static ssize do_write_file(const char *path, const u8 *buf, usize len) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
   u32 parent; char name[MAX_FILENAME]; u32 target;
@@ -121,8 +218,9 @@ ssize fs_write_file(const char *path, const u8 *buf, usize len) {
   Inode *in = &inode_table[target];
   if (in->is_dir) return -1;
   for (int i = 0; i < DIRECT_PTRS; i++) {
-    if (in->direct[i]) { clear_bitmap(in->direct[i]); sb.free_blocks++; in->direct[i]=0; }
+    if (in->direct[i]) { free_block(in->direct[i]); in->direct[i]=0; }
   }
+  touch_inode(target);
   usize needed = (len + BLOCK_SIZE - 1)/BLOCK_SIZE;
   if (needed > DIRECT_PTRS) return -1;
   usize written = 0;
@@ -141,7 +239,16 @@ ssize fs_write_file(const char *path, const u8 *buf, usize len) {
   return written;
 }
 
-ssize fs_read_file(const char *path, u8 *buf, usize maxlen) {
+ssize fs_write_file(const char *path, const u8 *buf, usize len) {
+  FS_PROBE2(write__entry, path, len);
+  int was = op_begin();
+  ssize r = do_write_file(path, buf, len);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(write__return, path, r);
+  return r;
+}
+
+static ssize do_read_file(const char *path, u8 *buf, usize maxlen) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
   u32 parent; char name[MAX_FILENAME]; u32 target;
@@ -153,18 +260,29 @@ ssize fs_read_file(const char *path, u8 *buf, usize maxlen) {
   usize read = 0;
   u8 blockbuf[BLOCK_SIZE];
   for (int i = 0; i < DIRECT_PTRS && read < toread; i++) {
-    if (!in->direct[i]) break;
-    ssize r = read_block(in->direct[i], blockbuf);
-    if (r <= 0) break;
     usize need = toread - read;
     usize copy = (need > BLOCK_SIZE) ? BLOCK_SIZE : need;
+    if (!in->direct[i]) { //hole left by truncate/punch, reads as zeros
+      memset(buf + read, 0, copy);
+      read += copy;
+      continue;
+    }
+    ssize r = read_block(in->direct[i], blockbuf);
+    if (r <= 0) break;
     memcpy(buf + read, blockbuf, copy);
     read += copy;
   }
   return read;
 }
 
-int fs_create_dir(const char *path) {
+ssize fs_read_file(const char *path, u8 *buf, usize maxlen) {
+  FS_PROBE2(read__entry, path, maxlen);
+  ssize r = do_read_file(path, buf, maxlen);
+  FS_PROBE2(read__return, path, r);
+  return r;
+}
+
+static int do_create_dir(const char *path) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
 
@@ -178,6 +296,7 @@ int fs_create_dir(const char *path) {
   strncpy(in->name, name, MAX_FILENAME-1);
   in->parent = parent;
   in->size = 0;
+  nameidx_add(ino);
   if (dir_add_entry(&inode_table[parent], name, ino) < 0) {
     free_inode(ino);
     return -1;
@@ -186,7 +305,16 @@ int fs_create_dir(const char *path) {
   return ino;
 }
 
-int fs_rename(const char *oldpath, const char *newpath) {
+int fs_create_dir(const char *path) {
+  FS_PROBE1(mkdir__entry, path);
+  int was = op_begin();
+  int r = do_create_dir(path);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(mkdir__return, path, r);
+  return r;
+}
+
+static int do_rename(const char *oldpath, const char *newpath) {
   const char *clean_old = oldpath;
   const char *clean_new = newpath;
   if (oldpath[0] == '/') clean_old = oldpath + 1;
@@ -202,12 +330,24 @@ int fs_rename(const char *oldpath, const char *newpath) {
   dir_add_entry(&inode_table[new_parent], new_name, old_target);
   Inode *in = &inode_table[old_target];
   in->parent = new_parent;
+  if (in->is_dir) path_cache_invalidate(); //every path below it changed
+  nameidx_remove(old_target);
   strncpy(in->name, new_name, MAX_FILENAME-1);
+  nameidx_add(old_target);
   sync_metadata();
   return 0;
 }
 
-int fs_unlink(const char *path) {
+int fs_rename(const char *oldpath, const char *newpath) {
+  FS_PROBE2(rename__entry, oldpath, newpath);
+  int was = op_begin();
+  int r = do_rename(oldpath, newpath);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE3(rename__return, oldpath, newpath, r);
+  return r;
+}
+
+static int do_unlink(const char *path) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
 
@@ -226,17 +366,95 @@ int fs_unlink(const char *path) {
   return 0;
 }
 
-void fs_list_dir_recursive(u32 ino, int depth) {
-  Inode *in = &inode_table[ino];
-  for (int i = 0; i < depth; i++) printf("  ");
-  printf("%s%s\n", in->name, in->is_dir ? "/" : "");
-  if (!in->is_dir) return;
-  usize cnt; DirEntry *arr = read_dir_entries(in, &cnt);
-  for (usize i = 0; i < cnt; i++) {
-    fs_list_dir_recursive(arr[i].inode_id, depth+1);
+int fs_unlink(const char *path) {
+  FS_PROBE1(unlink__entry, path);
+  int was = op_begin();
+  int r = do_unlink(path);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(unlink__return, path, r);
+  return r;
+}
+
+//listing output is collected here and written in large chunks
+#define LIST_OUT_BUF (256 * 1024)
+
+typedef struct ListOut {
+  char *buf;
+  usize len;
+} ListOut;
+
+static void list_flush(ListOut *o) {
+  if (o->len) fwrite(o->buf, 1, o->len, stdout);
+  o->len = 0;
+}
+
+static void list_entry(ListOut *o, const Inode *in, u32 depth, int long_fmt) {
+  //worst case line: long prefix, indentation and a full name
+  if (o->len + 32 + 2 * (usize)depth + MAX_FILENAME + 3 > LIST_OUT_BUF) list_flush(o);
+  if (o->len + 32 + 2 * (usize)depth + MAX_FILENAME + 3 > LIST_OUT_BUF) return; //absurdly deep, skip
+  char *p = o->buf + o->len;
+  if (long_fmt) p += sprintf(p, "%c %10u  ", in->is_dir ? 'd' : '-', in->size);
+  memset(p, ' ', 2 * (usize)depth);
+  p += 2 * depth;
+  usize nl = strnlen(in->name, MAX_FILENAME);
+  memcpy(p, in->name, nl);
+  p += nl;
+  if (in->is_dir) *p++ = '/';
+  *p++ = '\n';
+  o->len = p - o->buf;
+}
+
+typedef struct ListFrame {
+  u32 ino;
+  u32 depth;
+} ListFrame;
+
+//print the tree under ino depth first with an explicit stack, one reusable entry buffer
+//and buffered output. long_fmt prefixes each line with the type and size from the inode
+int fs_list_tree(u32 ino, int long_fmt) {
+  if (ino >= MAX_INODES) return -1;
+  ListOut out = { malloc(LIST_OUT_BUF), 0 };
+  usize scap = 64, top = 0, ecap = 0;
+  ListFrame *stack = malloc(sizeof(ListFrame) * scap);
+  DirEntry *ents = NULL;
+  int rc = 0;
+  if (!out.buf || !stack) { rc = -1; goto done; }
+
+  stack[top++] = (ListFrame){ ino, 0 };
+  while (top > 0) {
+    ListFrame f = stack[--top];
+    Inode *in = &inode_table[f.ino];
+    list_entry(&out, in, f.depth, long_fmt);
+    if (!in->is_dir || f.depth >= MAX_INODES) continue; //depth cap stops parent loops
+    ssize cnt = read_dir_entries_into(in, &ents, &ecap);
+    if (cnt < 0) { rc = -1; break; }
+    if (top + (usize)cnt > scap) {
+      usize ncap = scap;
+      while (top + (usize)cnt > ncap) ncap *= 2;
+      ListFrame *n = realloc(stack, sizeof(ListFrame) * ncap);
+      if (!n) { rc = -1; break; }
+      stack = n;
+      scap = ncap;
+    }
+    //pushed in reverse so children come out in directory order
+    for (ssize i = cnt - 1; i >= 0; i--) {
+      if (ents[i].inode_id >= MAX_INODES) continue;
+      stack[top++] = (ListFrame){ ents[i].inode_id, f.depth + 1 };
+    }
   }
-  free(arr);
+
+done:
+  if (out.buf) list_flush(&out);
+  fflush(stdout);
+  free(out.buf);
+  free(stack);
+  free(ents);
+  return rc;
 }
+
+//remove ino and everything below it. the subtree is collected first, then the entry
+//in the parent is dropped once and all inodes are freed in one pass. the child
+//directories are never rewritten since they go away as a whole
 int delete_inode_recursive(u32 ino) {
   if (ino == 0) return -1; // don't delete root 
   if (ino >= MAX_INODES) return -1;
@@ -244,39 +462,243 @@ int delete_inode_recursive(u32 ino) {
   Inode *node = &inode_table[ino];
   if (!node->used) return 0;//  already gone 
 
-  if (!node->is_dir) {
-    u32 parent = node->parent;
-    if (parent < MAX_INODES){
-      dir_remove_entry(&inode_table[parent], node->name);
-    }
-    free_inode(ino);
-    return 0;
-  }
+  u32 *subtree = malloc(sizeof(u32) * MAX_INODES);
+  u8 *seen = calloc(MAX_INODES, 1);
+  DirEntry *ents = NULL;
+  usize ecap = 0, n = 0;
+  if (!subtree || !seen) { free(subtree); free(seen); return -1; }
 
-  usize cnt = 0;
-  DirEntry *arr = read_dir_entries(node, &cnt);
-  for (usize i = 0; i < cnt; i++) {
-    u32 child = arr[i].inode_id;
-    delete_inode_recursive(child);
+  //breadth first, subtree doubles as the queue
+  subtree[n++] = ino;
+  seen[ino] = 1;
+  for (usize q = 0; q < n; q++) {
+    Inode *in = &inode_table[subtree[q]];
+    if (!in->is_dir) continue;
+    ssize cnt = read_dir_entries_into(in, &ents, &ecap);
+    if (cnt < 0) { free(subtree); free(seen); free(ents); return -1; }
+    for (ssize i = 0; i < cnt; i++) {
+      u32 child = ents[i].inode_id;
+      if (child == 0 || child >= MAX_INODES || seen[child] || !inode_table[child].used) continue;
+      seen[child] = 1;
+      subtree[n++] = child;
+    }
   }
-  free(arr);
+  free(ents);
+  free(seen);
 
+  int was = fs_defer_sync(1); //dir_remove_entry and free_inodes share one commit
   u32 parent = node->parent;
   if (parent < MAX_INODES){
     dir_remove_entry(&inode_table[parent], node->name);
   }
-  free_inode(ino);
-  return 0;
+  free_inodes(subtree, n);
+  fs_defer_sync(was);
+  free(subtree);
+  return was ? 0 : fs_commit();
 }
 
-int fs_delete_dir_recursive(const char *path) {
+static int do_delete_dir_recursive(const char *path) {
   const char *clean_path = path;
   if (path[0] == '/') clean_path = path + 1;
   u32 parent; char name[MAX_FILENAME]; u32 target;
   if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
   if (!target) return -1;
   if (target == 0) return -1; // don't delete root 
-  delete_inode_recursive(target);
+  return delete_inode_recursive(target);
+}
+
+int fs_delete_dir_recursive(const char *path) {
+  FS_PROBE1(rmtree__entry, path);
+  int r = do_delete_dir_recursive(path);
+  FS_PROBE2(rmtree__return, path, r);
+  return r;
+}
+
+//make dst a new file sharing all of src_ino's data blocks, writes to either copy later
+//go through copy-on-write in fh_write so this never touches file data
+static int do_clone_inode(u32 src_ino, const char *dst) {
+  if (src_ino == 0 || src_ino >= MAX_INODES) return -1;
+  Inode *src = &inode_table[src_ino];
+  if (!src->used || src->is_dir) return -1;
+  int ino = fs_create_file(dst);
+  if (ino <= 0) return -1;
+  Inode *in = &inode_table[ino];
+  for (int i = 0; i < DIRECT_PTRS; i++) {
+    if (!src->direct[i]) continue;
+    if (share_block(src->direct[i]) < 0) {
+      //out of references, undo what was shared so far and drop the new file
+      for (int j = 0; j < i; j++) {
+        if (in->direct[j]) { free_block(in->direct[j]); in->direct[j] = 0; }
+      }
+      fs_unlink(dst);
+      return -1;
+    }
+    in->direct[i] = src->direct[i];
+  }
+  in->size = src->size;
+  touch_inode(ino);
   sync_metadata();
+  return ino;
+}
+
+int fs_clone_inode(u32 src_ino, const char *dst) {
+  FS_PROBE2(clone__entry, src_ino, dst);
+  int was = op_begin();
+  int r = do_clone_inode(src_ino, dst);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE3(clone__return, src_ino, dst, r);
+  return r;
+}
+
+int fs_clone_file(const char *src, const char *dst) {
+  const char *clean_path = src;
+  if (src[0] == '/') clean_path = src + 1;
+  u32 parent; char name[MAX_FILENAME]; u32 target;
+  if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
+  if (!target) return -1;
+  return fs_clone_inode(target, dst);
+}
+
+//give inode its own copy of block bi if that block is shared with a clone
+static int unshare_block(u32 ino, u32 bi) {
+  Inode *in = &inode_table[ino];
+  u32 old = in->direct[bi];
+  if (!old || !block_shared(old)) return 0;
+  u8 blockbuf[BLOCK_SIZE];
+  if (read_block(old, blockbuf) != BLOCK_SIZE) return -1;
+  u32 b = allocate_block();
+  if (!b) return -1;
+  if (write_block(b, blockbuf) != BLOCK_SIZE) { free_block(b); return -1; }
+  free_block(old);
+  in->direct[bi] = b;
+  touch_inode(ino);
   return 0;
 }
+
+//zero bytes [from, to) inside block bi, the block must be mapped
+static int zero_block_range(u32 ino, u32 bi, u32 from, u32 to) {
+  if (unshare_block(ino, bi) < 0) return -1;
+  u32 b = inode_table[ino].direct[bi];
+  u8 blockbuf[BLOCK_SIZE];
+  if (read_block(b, blockbuf) != BLOCK_SIZE) return -1;
+  memset(blockbuf + from, 0, to - from);
+  return write_block(b, blockbuf) == BLOCK_SIZE ? 0 : -1;
+}
+
+//shrink or grow a file, only the blocks past the new end are touched
+static int do_truncate(u32 ino, u64 newsize) {
+  if (ino == 0 || ino >= MAX_INODES) return -1;
+  Inode *in = &inode_table[ino];
+  if (!in->used || in->is_dir) return -1;
+  if (newsize > (u64)DIRECT_PTRS * BLOCK_SIZE) return -1;
+  u32 keep = (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (u32 i = keep; i < DIRECT_PTRS; i++) {
+    if (in->direct[i]) { free_block(in->direct[i]); in->direct[i] = 0; }
+  }
+  //clear the tail of the new last block so growing later reads zeros
+  u32 tail = newsize % BLOCK_SIZE;
+  if (newsize < in->size && tail && in->direct[keep-1]) {
+    if (zero_block_range(ino, keep-1, tail, BLOCK_SIZE) < 0) return -1;
+  }
+  in->size = (u32)newsize;
+  touch_inode(ino);
+  return sync_metadata();
+}
+
+int fs_truncate(u32 ino, u64 newsize) {
+  FS_PROBE2(truncate__entry, ino, newsize);
+  int was = op_begin();
+  int r = do_truncate(ino, newsize);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(truncate__return, ino, r);
+  return r;
+}
+
+//map every hole in [first, last) to zeroed blocks, one contiguous run when possible
+static int fallocate_range(u32 ino, u32 first, u32 last) {
+  Inode *in = &inode_table[ino];
+  u32 holes = 0, lo = last, hi = first;
+  for (u32 i = first; i < last; i++) {
+    if (in->direct[i]) continue;
+    holes++;
+    if (i < lo) lo = i;
+    hi = i + 1;
+  }
+  if (!holes) return 0;
+
+  u8 zero[BLOCK_SIZE];
+  memset(zero, 0, BLOCK_SIZE);
+  u32 run = (holes == hi - lo) ? allocate_run(holes) : 0;
+  if (run) {
+    u8 *zeros = calloc(holes, BLOCK_SIZE);
+    if (!zeros || write_blocks(run, holes, zeros) != (ssize)holes * BLOCK_SIZE) {
+      free(zeros);
+      for (u32 k = 0; k < holes; k++) free_block(run + k);
+      return -1;
+    }
+    free(zeros);
+    for (u32 k = 0; k < holes; k++) in->direct[lo + k] = run + k;
+  } else {
+    //fragmented free space or holes in between mapped blocks
+    for (u32 i = lo; i < hi; i++) {
+      if (in->direct[i]) continue;
+      u32 b = allocate_block();
+      if (!b) { touch_inode(ino); return -1; }
+      if (write_block(b, zero) != BLOCK_SIZE) { free_block(b); touch_inode(ino); return -1; }
+      in->direct[i] = b;
+    }
+  }
+  touch_inode(ino);
+  return 0;
+}
+
+//free whole blocks inside [off, end) and zero the partial ones at the edges
+static int punch_range(u32 ino, u64 off, u64 end) {
+  Inode *in = &inode_table[ino];
+  u32 first = off / BLOCK_SIZE;
+  u32 last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (u32 i = first; i < last && i < DIRECT_PTRS; i++) {
+    if (!in->direct[i]) continue;
+    u64 bstart = (u64)i * BLOCK_SIZE;
+    u32 from = off > bstart ? (u32)(off - bstart) : 0;
+    u32 to = end < bstart + BLOCK_SIZE ? (u32)(end - bstart) : BLOCK_SIZE;
+    if (from == 0 && to == BLOCK_SIZE) {
+      free_block(in->direct[i]);
+      in->direct[i] = 0;
+    } else if (zero_block_range(ino, i, from, to) < 0) {
+      return -1;
+    }
+  }
+  touch_inode(ino);
+  return 0;
+}
+
+static int do_fallocate(u32 ino, int mode, u64 off, u64 len) {
+  if (ino == 0 || ino >= MAX_INODES) return -1;
+  Inode *in = &inode_table[ino];
+  if (!in->used || in->is_dir || len == 0) return -1;
+  u64 end = off + len;
+  if (mode & FS_FALLOC_PUNCH_HOLE) {
+    if (!(mode & FS_FALLOC_KEEP_SIZE)) return -1; //same rule as linux
+    //keep size can map blocks past eof, those must be punchable too
+    if (end > (u64)DIRECT_PTRS * BLOCK_SIZE) end = (u64)DIRECT_PTRS * BLOCK_SIZE;
+    if (off >= end) return 0;
+    int r = punch_range(ino, off, end);
+    sync_metadata();
+    return r;
+  }
+  if (end > (u64)DIRECT_PTRS * BLOCK_SIZE) return -1;
+  int r = fallocate_range(ino, off / BLOCK_SIZE, (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  if (r == 0 && !(mode & FS_FALLOC_KEEP_SIZE) && end > in->size) in->size = (u32)end;
+  sync_metadata();
+  return r;
+}
+
+int fs_fallocate(u32 ino, int mode, u64 off, u64 len) {
+  FS_PROBE3(fallocate__entry, ino, off, len);
+  int was = op_begin();
+  int r = do_fallocate(ino, mode, off, len);
+  if (op_end(was) < 0) r = -1;
+  FS_PROBE2(fallocate__return, ino, r);
+  return r;
+}
@@ -10,6 +10,8 @@
 #include <sys/wait.h>
 #include <limits.h>
 #include <stdint.h>
+#include <sys/statvfs.h>
+#include <linux/falloc.h>
 
 #include "virt_disk.h"
 
@@ -28,9 +30,11 @@ static void try_loading_fs_metadata(void){
   }
 }
 
-static void sync_and_reload(void){
-  sync_metadata();
-  load_fs();
+//the daemon owns the image, so the in-memory metadata is the truth. rereading it here
+//would throw away block pointers and sizes that open handles have not flushed yet.
+//the fs_* call already committed its own change, this only writes what is still dirty
+static void sync_after_change(void){
+  fs_commit();
 }
 
 static void inode_to_stat(u32 ino,struct stat * st){
@@ -66,8 +70,59 @@ static int path_to_inode(const char *path,u32 *out_ino){
   return 0;
 }
 
+static int is_stats_file(const char *path){
+  return path && strcmp(path,STATS_FILE) == 0;
+}
+
+//the stats file is not in the image, latency histograms and i/o counters are
+//formatted fresh for every getattr and read
+//the formatters return the length they wanted, which can outgrow the buffer when other
+//threads bump the counters in between, so only what fits is counted
+static usize clamp_written(usize wanted,usize cap){
+  return wanted < cap ? wanted : (cap ? cap - 1 : 0);
+}
+
+//size and fill again until both sections fit, a few tries cover any realistic growth
+static char* stats_text(usize *out_len){
+  usize cap = stats_format(NULL,0) + io_format(NULL,0) + 1;
+  for(int tries = 0; ; tries++){
+    char *text = malloc(cap);
+    if(!text) return NULL;
+    usize lat_want = stats_format(text,cap);
+    usize lat = clamp_written(lat_want,cap);
+    usize io_want = io_format(text + lat,cap - lat);
+    usize io = clamp_written(io_want,cap - lat);
+    if((lat == lat_want && io == io_want) || tries == 3){
+      *out_len = lat + io;
+      return text;
+    }
+    free(text);
+    cap = lat_want + io_want + 256; //room for a little more growth
+  }
+}
+
+static int stats_file_read(char *buf,size_t size,off_t offset){
+  usize len;
+  char *text = stats_text(&len);
+  if(!text) return -ENOMEM;
+  int n = 0;
+  if((u64)offset < len){ //len counts bytes actually in text
+    n = (int)((len - offset) < size ? (len - offset) : size);
+    memcpy(buf,text + offset,n);
+  }
+  free(text);
+  return n;
+}
+
 static int fsfuse_getattr(const char *path, struct stat *stbuf){
   u32 ino;
+  if(is_stats_file(path)){
+    inode_to_stat(MAX_INODES,stbuf); //plain 0644 file
+    usize len = 0;
+    free(stats_text(&len));
+    stbuf->st_size = len;
+    return 0;
+  }
   if(strcmp(path,"/") == 0){
     inode_to_stat(0,stbuf);
     return 0;
@@ -79,10 +134,6 @@ static int fsfuse_getattr(const char *path, struct stat *stbuf){
 
 static int fsfuse_readdir(const char *path,void *buf,fuse_fill_dir_t filler,off_t offset, struct fuse_file_info *fi){
   (void) offset; (void) fi;
-  if (load_fs() < 0 ){
-    fprintf(stderr,"fuse_bridge load_fs failed in readdir\n");
-    return -ENOENT;
-  }
   u32 ino;
   if(strcmp(path,"/") == 0 ) ino = 0;
   else if(path_to_inode(path,&ino) < 0) return -ENOENT;
@@ -102,70 +153,70 @@ static int fsfuse_readdir(const char *path,void *buf,fuse_fill_dir_t filler,off_
   return 0;
 }
 
+static FileHandle *get_handle(struct fuse_file_info *fi){
+  if(!fi) return NULL;
+  return (FileHandle *)(uintptr_t)fi->fh;
+}
+
 static int fsfuse_open(const char *path,struct fuse_file_info *fi){
   u32 ino;
+  if(is_stats_file(path)){
+    fi->fh = 0;
+    fi->direct_io = 1; //size changes between getattr and read
+    return 0;
+  }
   if(path_to_inode(path,&ino) < 0) return -ENOENT;
 
   if(inode_table[ino].is_dir) return -EISDIR;
 
+  //resolve the path once here, read/write work straight off the handle
+  FileHandle *fh = fh_open(ino);
+  if(!fh) return -ENOMEM;
+  fi->fh = (uint64_t)(uintptr_t)fh;
   return 0;
 
 }
 
 static int fsfuse_read(const char *path,char *buf,size_t size, off_t offset,struct fuse_file_info *fi){
-  u32 ino;
-  if(path_to_inode(path,&ino) < 0) return -ENOENT;
-
-  Inode *inode = &inode_table[ino];
-  //if its directory then returning error
-  if(inode->is_dir) return -EISDIR;
-  
-  //checking if offset is larger than file size
-  if(offset >= inode->size) return 0;
-
-  //calculating the data size we need to read
-  usize remaining = inode->size - offset;
-  usize to_read = size < remaining ? size : remaining;
-
-  u8 *temp_buf = malloc(inode->size);
-  if(!temp_buf) return -ENOMEM;
+  if(is_stats_file(path)) return stats_file_read(buf,size,offset);
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return -EBADF;
+
+  ssize r = fh_read(fh,(u8 *)buf,size,offset);
+  if(r == -ESTALE) return -ESTALE;
+  if(r < 0) return -EIO;
+  return r;
+}
 
-  ssize read_total = fs_read_file(path,temp_buf,inode->size);
-  if(read_total < 0){
-    free(temp_buf);
-    return -EIO;
-  }
-  //copy requested portion
-  if(offset < read_total){
-    usize copy_size = to_read;
-    if(offset + copy_size > read_total){
-      copy_size = read_total - offset;
-    }
-    memcpy(buf,temp_buf + offset , copy_size);
-  }else{
-    free(temp_buf);
-    return 0;
+static int fsfuse_write(const char *path, const char *buf,usize size, off_t offset,struct fuse_file_info *fi){
+  if(is_stats_file(path)){
+    stats_reset(); //any write clears the histograms and the i/o counters
+    io_reset();
+    return size;
   }
-  free(temp_buf);
-  return to_read;
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return -EBADF;
+
+  ssize r = fh_write(fh,(const u8 *)buf,size,offset);
+  if(r == -ESTALE) return -ESTALE;
+  if(r < 0) return (offset + size > (u64)DIRECT_PTRS * BLOCK_SIZE) ? -EFBIG : -ENOSPC;
+  return r;
 }
 
-static int fsfuse_write(const char *path, const char *buf,usize size, off_t offset,struct fuse_file_info *fi){
-  u32 ino;
-  if(path_to_inode(path,&ino) < 0) return -ENOENT;
+static int fsfuse_flush(const char *path,struct fuse_file_info *fi){
+  (void) path;
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return 0;
+  if(fh_flush(fh) < 0) return -EIO;
+  return 0;
+}
 
-  Inode *inode = &inode_table[ino];
-  if(inode -> is_dir) return -EISDIR;
-  //for simplicity , writing entire file at once
-  //else need implementation which can handle partial writes
-  ssize result = fs_write_file(path,(const u8 *)buf,size);
-  if(result <0) return -EIO;
-
-  //updating inode size
-  inode->size = result;
-  sync_metadata();
-  
-  return result;
+static int fsfuse_release(const char *path,struct fuse_file_info *fi){
+  (void) path;
+  FileHandle *fh = get_handle(fi);
+  fh_close(fh);
+  fi->fh = 0;
+  return 0;
 }
 
 static int fsfuse_mkdir(const char *path, mode_t mode){
@@ -176,20 +227,23 @@ static int fsfuse_mkdir(const char *path, mode_t mode){
   return -EIO; //something went wroing
   }
   fprintf(stderr, "fuse_bridge:fs_create_dir('%s') -> %d success\n",path,r);
-  sync_and_reload(); //success by 0
+  sync_after_change(); //success by 0
   
   return 0;
 }
 
 static int fsfuse_create(const char *path,mode_t mode,struct fuse_file_info *fi){
-  (void) mode; (void) fi;
+  (void) mode;
   int r = fs_create_file(path);
   if(r < 0) {
   fprintf(stderr, "fuse_bridge:fs_create_file('%s') -> %d failed\n",path,r);
   return -EIO; //something went wroing
   }
   fprintf(stderr, "fuse_bridge:fs_create_file('%s') -> %d success\n",path,r);
-  sync_and_reload();
+  sync_after_change();
+  FileHandle *fh = fh_open((u32)r);
+  if(!fh) return -ENOMEM;
+  fi->fh = (uint64_t)(uintptr_t)fh;
   return 0; //success by 0
 }
 
@@ -200,7 +254,7 @@ static int fsfuse_unlink(const char *path){
   return -EIO; //something went wroing
   }
   fprintf(stderr, "fuse_bridge:fs_unlink('%s') -> %d success\n",path,r);
-  sync_and_reload();
+  sync_after_change();
   return 0; //success by 0
 }
 
@@ -234,7 +288,7 @@ static int fsfuse_rename(const char *oldpath,const char *newpath){
   return -EIO; //something went wroing
   }
   fprintf(stderr, "fuse_bridge:fs_rename(' %s , %s ') -> %d success\n",oldpath,newpath,r);
-  sync_and_reload();
+  sync_after_change();
   return 0; //success by 0
 }
 
@@ -244,19 +298,162 @@ static int fsfuse_utimens(const char *path,const struct timespec tv[2]){
   return 0;
 }
 
+static int fsfuse_statfs(const char *path,struct statvfs *st){
+  (void) path;
+  u32 free_blocks,free_inodes;
+  fs_counters(&free_blocks,&free_inodes); //constant time, no bitmap scan
+  memset(st,0,sizeof(*st));
+  st->f_bsize = sb.block_size;
+  st->f_frsize = sb.block_size;
+  st->f_blocks = sb.total_blocks - sb.data_block_start; //only data blocks are usable
+  st->f_bfree = free_blocks;
+  st->f_bavail = free_blocks;
+  st->f_files = sb.total_inodes;
+  st->f_ffree = free_inodes;
+  st->f_favail = free_inodes;
+  st->f_namemax = MAX_FILENAME - 1;
+  return 0;
+}
+
+static int truncate_errno(u32 ino,off_t size){
+  if(inode_table[ino].is_dir) return -EISDIR;
+  if(size < 0) return -EINVAL;
+  if((u64)size > (u64)DIRECT_PTRS * BLOCK_SIZE) return -EFBIG;
+  if(fs_truncate(ino,(u64)size) < 0) return -EIO;
+  return 0;
+}
+
+static int fsfuse_truncate(const char *path,off_t size){
+  u32 ino;
+  if(is_stats_file(path)) return 0; //so "echo > /.fsstats" gets to its write
+  if(path_to_inode(path,&ino) < 0) return -ENOENT;
+  return truncate_errno(ino,size);
+}
+
+static int fsfuse_ftruncate(const char *path,off_t size,struct fuse_file_info *fi){
+  if(is_stats_file(path)) return 0;
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return -EBADF;
+  return truncate_errno(fh->ino,size);
+}
+
+static int fsfuse_fallocate(const char *path,int mode,off_t offset,off_t length,struct fuse_file_info *fi){
+  (void) path;
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return -EBADF;
+  if(offset < 0 || length <= 0) return -EINVAL;
+  if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+  if((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+
+  int fs_mode = 0;
+  if(mode & FALLOC_FL_KEEP_SIZE) fs_mode |= FS_FALLOC_KEEP_SIZE;
+  if(mode & FALLOC_FL_PUNCH_HOLE) fs_mode |= FS_FALLOC_PUNCH_HOLE;
+  if(!(fs_mode & FS_FALLOC_PUNCH_HOLE) && (u64)offset + (u64)length > (u64)DIRECT_PTRS * BLOCK_SIZE) return -EFBIG;
+  if(fs_fallocate(fh->ino,fs_mode,(u64)offset,(u64)length) < 0) return -ENOSPC;
+  return 0;
+}
+
+//fuse 2.9 has no copy_file_range, server side copies come in as VDISK_IOC_CLONE
+static int fsfuse_ioctl(const char *path,int cmd,void *arg,struct fuse_file_info *fi,unsigned int flags,void *data){
+  (void) arg; (void) flags;
+  if((unsigned int)cmd != VDISK_IOC_CLONE) return -ENOTTY;
+  FileHandle *fh = get_handle(fi);
+  if(!fh) return -EBADF;
+  CloneReq *req = data;
+  req->dst[sizeof(req->dst)-1] = '\0';
+  int r = fs_clone_inode(fh->ino,req->dst);
+  if(r < 0) {
+  fprintf(stderr, "fuse_bridge:fs_clone_inode('%s' -> '%s') -> %d failed\n",path,req->dst,r);
+  return -EIO;
+  }
+  fprintf(stderr, "fuse_bridge:fs_clone_inode('%s' -> '%s') -> %d success\n",path,req->dst,r);
+  sync_after_change();
+  return 0;
+}
+
+//every hook goes through a timed wrapper that feeds its latency histogram, requests
+//over the slow-op threshold also go to the slow log with the i/o they caused and with
+//--trace every request is appended to the operation trace
+typedef struct HookArgs {
+  const char *path2; // rename target, clone destination 
+  u64 off;
+  u64 len;
+  u32 mode;
+} HookArgs;
+
+static void hook_done(int op,u16 tr,const char *path,const HookArgs *a,struct fuse_file_info *fi,
+                      u64 t0,u64 ios0,u64 syncs0,int r){
+  stats_record(op,t0);
+  FileHandle *fh = get_handle(fi);
+  if(trace_enabled()){
+    trace_record(tr,t0,path,a->path2,fh ? fh->ino : TRACE_NO_INO,a->off,a->len,a->mode,r);
+  }
+  if(!slowlog_threshold()) return;
+  u64 ns = stats_now() - t0;
+  if(ns < slowlog_threshold()) return;
+  u64 ios,syncs;
+  io_thread_totals(&ios,&syncs);
+  slowlog_record(stats_op_name(op),path,fh ? (long)fh->ino : -1,ns,ios - ios0,syncs - syncs0);
+}
+
+#define TIMED_HOOK(op,tr,path,fi,args,call) do { \
+    HookArgs a = args; \
+    u64 ios0,syncs0; io_thread_totals(&ios0,&syncs0); \
+    u64 t0 = stats_now(); int r = (call); hook_done((op),(tr),(path),&a,(fi),t0,ios0,syncs0,r); return r; \
+  } while(0)
+#define NO_ARGS ((HookArgs){ NULL, 0, 0, 0 })
+
+static int timed_getattr(const char *path, struct stat *stbuf){ TIMED_HOOK(ST_FUSE_GETATTR,TR_GETATTR,path,NULL,NO_ARGS,fsfuse_getattr(path,stbuf)); }
+static int timed_readdir(const char *path,void *buf,fuse_fill_dir_t filler,off_t offset, struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_READDIR,TR_READDIR,path,fi,NO_ARGS,fsfuse_readdir(path,buf,filler,offset,fi)); }
+static int timed_open(const char *path,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_OPEN,TR_OPEN,path,fi,NO_ARGS,fsfuse_open(path,fi)); }
+static int timed_read(const char *path,char *buf,size_t size, off_t offset,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_READ,TR_READ,path,fi,((HookArgs){ NULL, (u64)offset, size, 0 }),fsfuse_read(path,buf,size,offset,fi)); }
+static int timed_write(const char *path, const char *buf,usize size, off_t offset,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_WRITE,TR_WRITE,path,fi,((HookArgs){ NULL, (u64)offset, size, 0 }),fsfuse_write(path,buf,size,offset,fi)); }
+static int timed_flush(const char *path,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_FLUSH,TR_FLUSH,path,fi,NO_ARGS,fsfuse_flush(path,fi)); }
+static int timed_release(const char *path,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_RELEASE,TR_RELEASE,path,fi,NO_ARGS,fsfuse_release(path,fi)); }
+static int timed_mkdir(const char *path, mode_t mode){ TIMED_HOOK(ST_FUSE_MKDIR,TR_MKDIR,path,NULL,NO_ARGS,fsfuse_mkdir(path,mode)); }
+static int timed_create(const char *path,mode_t mode,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_CREATE,TR_CREATE,path,fi,NO_ARGS,fsfuse_create(path,mode,fi)); }
+static int timed_unlink(const char *path){ TIMED_HOOK(ST_FUSE_UNLINK,TR_UNLINK,path,NULL,NO_ARGS,fsfuse_unlink(path)); }
+static int timed_rmdir(const char *path){ TIMED_HOOK(ST_FUSE_RMDIR,TR_RMDIR,path,NULL,NO_ARGS,fsfuse_rmdir(path)); }
+static int timed_rename(const char *oldpath,const char *newpath){ TIMED_HOOK(ST_FUSE_RENAME,TR_RENAME,oldpath,NULL,((HookArgs){ newpath, 0, 0, 0 }),fsfuse_rename(oldpath,newpath)); }
+static int timed_utimens(const char *path,const struct timespec tv[2]){ TIMED_HOOK(ST_FUSE_UTIMENS,TR_UTIMENS,path,NULL,NO_ARGS,fsfuse_utimens(path,tv)); }
+static int timed_statfs(const char *path,struct statvfs *st){ TIMED_HOOK(ST_FUSE_STATFS,TR_STATFS,path,NULL,NO_ARGS,fsfuse_statfs(path,st)); }
+static int timed_ioctl(const char *path,int cmd,void *arg,struct fuse_file_info *fi,unsigned int flags,void *data){
+  //the only ioctl is clone, its destination is in the request 
+  const char *dst = ((unsigned int)cmd == VDISK_IOC_CLONE && data) ? ((CloneReq *)data)->dst : NULL;
+  TIMED_HOOK(ST_FUSE_IOCTL,TR_CLONE,path,fi,((HookArgs){ dst, 0, 0, 0 }),fsfuse_ioctl(path,cmd,arg,fi,flags,data));
+}
+static int timed_truncate(const char *path,off_t size){ TIMED_HOOK(ST_FUSE_TRUNCATE,TR_TRUNCATE,path,NULL,((HookArgs){ NULL, 0, (u64)size, 0 }),fsfuse_truncate(path,size)); }
+static int timed_ftruncate(const char *path,off_t size,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_FTRUNCATE,TR_FTRUNCATE,path,fi,((HookArgs){ NULL, 0, (u64)size, 0 }),fsfuse_ftruncate(path,size,fi)); }
+static int timed_fallocate(const char *path,int mode,off_t offset,off_t length,struct fuse_file_info *fi){ TIMED_HOOK(ST_FUSE_FALLOCATE,TR_FALLOCATE,path,fi,((HookArgs){ NULL, (u64)offset, (u64)length, (u32)mode }),fsfuse_fallocate(path,mode,offset,length,fi)); }
+
+//runs in the serving process, after fuse_main has forked into the background
+static void* fsfuse_init(struct fuse_conn_info *conn){
+  (void) conn;
+  if(slowlog_start() < 0) fprintf(stderr,"fuse_bridge: slow-op log flusher not started\n");
+  return NULL;
+}
+
 //fuse operations hooks handler 
 static struct fuse_operations myfs_ops = {
-  .getattr = fsfuse_getattr,
-  .readdir = fsfuse_readdir,
-  .open    = fsfuse_open,
-  .read    = fsfuse_read,
-  .write   = fsfuse_write,
-  .mkdir   = fsfuse_mkdir,
-  .create  = fsfuse_create,
-  .unlink  = fsfuse_unlink,
-  .rmdir   = fsfuse_rmdir,
-  .rename  = fsfuse_rename,
-  .utimens  = fsfuse_utimens,
+  .init    = fsfuse_init,
+  .getattr = timed_getattr,
+  .readdir = timed_readdir,
+  .open    = timed_open,
+  .read    = timed_read,
+  .write   = timed_write,
+  .flush   = timed_flush,
+  .release = timed_release,
+  .mkdir   = timed_mkdir,
+  .create  = timed_create,
+  .unlink  = timed_unlink,
+  .rmdir   = timed_rmdir,
+  .rename  = timed_rename,
+  .utimens  = timed_utimens,
+  .statfs  = timed_statfs,
+  .ioctl   = timed_ioctl,
+  .truncate  = timed_truncate,
+  .ftruncate = timed_ftruncate,
+  .fallocate = timed_fallocate,
 };
 
 
@@ -267,6 +464,26 @@ int main(int argc, char **argv)
   try_loading_fs_metadata();
   int i;
 
+  //our own options, taken out before fuse sees the arguments
+  const char *slowlog = NULL, *trace = NULL;
+  u64 slow_ms = SLOWLOG_DEFAULT_MS;
+  for (i = 1; i < argc; ) {
+    if (strncmp(argv[i],"--slowlog=",10) == 0) slowlog = argv[i] + 10;
+    else if (strncmp(argv[i],"--slow-ms=",10) == 0) slow_ms = strtoull(argv[i] + 10,NULL,10);
+    else if (strncmp(argv[i],"--trace=",8) == 0) trace = argv[i] + 8;
+    else if (strcmp(argv[i],"--trace-blocks") == 0) trace_set_blocks(1);
+    else { i++; continue; }
+    for (int j = i; j < argc - 1; j++) argv[j] = argv[j + 1];
+    argc--;
+    argv[argc] = NULL;
+  }
+  if (slowlog && slowlog_open(slowlog,slow_ms) < 0) {
+    fprintf(stderr,"fuse_bridge: cannot open slow-op log '%s'\n",slowlog);
+  }
+  if (trace && trace_open(trace) < 0) {
+    fprintf(stderr,"fuse_bridge: cannot open trace file '%s'\n",trace);
+  }
+
   printf("starting fuse filesystem (no operations implemented)\n");
 
   //Get the device or image filename from arguments (if provided)
@@ -285,5 +502,9 @@ int main(int argc, char **argv)
 
   //Pass control to FUSE
   //For FUSE 2.9.9, use the 4-argument version
-  return fuse_main(argc, argv, &myfs_ops, NULL);
+  int r = fuse_main(argc, argv, &myfs_ops, NULL);
+  unload_fs(); //unmounted, the image is consistent again
+  slowlog_close();
+  trace_close();
+  return r;
 }
@@ -0,0 +1,239 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+#include<sys/stat.h>
+
+//two chunk buffers, the reader thread fills one while the image side drains the other
+typedef struct ChunkPipe {
+  int fd;
+  u8 *buf[2];
+  ssize len[2];              // bytes in the slot, 0 = eof, -1 = read error 
+  int full[2];
+  int stop;                  // consumer gave up, reader should exit 
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ChunkPipe;
+
+static ssize read_chunk(int fd, u8 *buf, usize cap) {
+  usize done = 0;
+  while (done < cap) {
+    ssize r = read(fd, buf + done, cap - done);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) break;
+    done += (usize)r;
+  }
+  return (ssize)done;
+}
+
+static void* chunk_reader(void *arg) {
+  ChunkPipe *p = arg;
+  for (int slot = 0;; slot ^= 1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->full[slot] && !p->stop) pthread_cond_wait(&p->cond, &p->lock);
+    int stop = p->stop;
+    pthread_mutex_unlock(&p->lock);
+    if (stop) break;
+
+    ssize r = read_chunk(p->fd, p->buf[slot], HOSTIO_CHUNK);
+
+    pthread_mutex_lock(&p->lock);
+    p->len[slot] = r;
+    p->full[slot] = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (r <= 0) break;
+  }
+  return NULL;
+}
+
+//map one contiguous run for size bytes straight into direct[] of an empty file. the
+//data written next covers every block, only a partial last block can keep old bytes
+//past the end, so that one alone is zeroed. returns the reserved bytes, 0 if no run
+static u64 reserve_run(u32 ino, u64 size) {
+  u32 count = (u32)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  u32 run = allocate_run(count);
+  if (!run) return 0; //fragmented, fh_write allocates block by block instead
+  if (size % BLOCK_SIZE) {
+    u8 zero[BLOCK_SIZE];
+    memset(zero, 0, BLOCK_SIZE);
+    if (write_block(run + count - 1, zero) != BLOCK_SIZE) {
+      for (u32 k = 0; k < count; k++) free_block(run + k);
+      return 0;
+    }
+  }
+  Inode *in = &inode_table[ino];
+  for (u32 k = 0; k < count; k++) in->direct[k] = run + k;
+  touch_inode(ino);
+  return size;
+}
+
+//copy everything readable from fd into dst (created if missing, truncated otherwise)
+//returns bytes written, -EFBIG when a regular file source cannot fit (dst untouched)
+//or -1. metadata is committed once at the end
+ssize fs_import_fd(int fd, const char *dst) {
+  //known size: check it before the target is created or emptied
+  struct stat st;
+  u64 src_size = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    if ((u64)st.st_size > (u64)DIRECT_PTRS * BLOCK_SIZE) return -EFBIG;
+    src_size = (u64)st.st_size;
+  }
+  const char *clean_path = dst;
+  if (dst[0] == '/') clean_path = dst + 1;
+  u32 parent; char name[MAX_FILENAME]; u32 target;
+  if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
+  if (!target) {
+    int ino = fs_create_file(dst);
+    if (ino <= 0) return -1;
+    target = (u32)ino;
+  }
+  if (inode_table[target].is_dir) return -1;
+
+  int was_deferred = fs_defer_sync(1);
+  ssize total = -1;
+  FileHandle *fh = NULL;
+  ChunkPipe p;
+  memset(&p, 0, sizeof(p));
+  p.fd = fd;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  p.buf[0] = malloc(HOSTIO_CHUNK);
+  p.buf[1] = malloc(HOSTIO_CHUNK);
+  if (!p.buf[0] || !p.buf[1]) goto out;
+  if (fs_truncate(target, 0) < 0) goto out;
+
+  //reserve a known size up front so the data lands in one contiguous run
+  u64 reserved = src_size ? reserve_run(target, src_size) : 0;
+
+  fh = fh_open(target);
+  if (!fh) goto out;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, chunk_reader, &p) != 0) goto out;
+
+  total = 0;
+  for (int slot = 0;; slot ^= 1) {
+    pthread_mutex_lock(&p.lock);
+    while (!p.full[slot]) pthread_cond_wait(&p.cond, &p.lock);
+    ssize len = p.len[slot];
+    pthread_mutex_unlock(&p.lock);
+    if (len < 0) { total = -1; break; }
+    if (len == 0) break;
+    if (fh_write(fh, p.buf[slot], (usize)len, total) != len) { total = -1; break; }
+    total += len;
+
+    pthread_mutex_lock(&p.lock);
+    p.full[slot] = 0;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+  }
+  pthread_mutex_lock(&p.lock);
+  p.stop = 1;
+  pthread_cond_broadcast(&p.cond);
+  pthread_mutex_unlock(&p.lock);
+  pthread_join(tid, NULL);
+
+  //drop whatever was reserved past the real end, or everything on failure. the
+  //reservation counts as file size here so truncate zeroes the new last block's tail
+  u64 keep = total >= 0 ? (u64)total : 0;
+  if (reserved > inode_table[target].size) inode_table[target].size = (u32)reserved;
+  fs_truncate(target, keep);
+out:
+  fh_close(fh);
+  free(p.buf[0]);
+  free(p.buf[1]);
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.cond);
+  fs_defer_sync(was_deferred);
+  if (!was_deferred) fs_commit();
+  return total;
+}
+
+int host_write_all(int fd, const u8 *buf, usize len) {
+  usize done = 0;
+  while (done < len) {
+    ssize w = write(fd, buf + done, len - done);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += (usize)w;
+  }
+  return 0;
+}
+
+//fill buf with up to max_blocks file blocks starting at *bi, one pread per run of
+//blocks that are adjacent on the image, holes become zeros. returns blocks filled or -1
+static int gather_blocks(Inode *in, u32 *bi, u32 nblocks, u8 *buf, u32 max_blocks) {
+  u32 filled = 0;
+  u32 i = *bi;
+  while (filled < max_blocks && i < nblocks) {
+    u8 *dst = buf + (usize)filled * BLOCK_SIZE;
+    u32 b = in->direct[i];
+    if (!b) { //hole
+      memset(dst, 0, BLOCK_SIZE);
+      filled++; i++;
+      continue;
+    }
+    u32 n = 1;
+    while (filled + n < max_blocks && i + n < nblocks && in->direct[i + n] == b + n) n++;
+    if (read_blocks(b, n, dst) != (ssize)n * BLOCK_SIZE) return -1;
+    filled += n; i += n;
+  }
+  *bi = i;
+  return (int)filled;
+}
+
+static u32 file_blocks(Inode *in) {
+  u32 nblocks = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  return nblocks > DIRECT_PTRS ? DIRECT_PTRS : nblocks;
+}
+
+//read a whole file into buf, cap must be at least DIRECT_PTRS * BLOCK_SIZE
+ssize fs_read_inode_raw(u32 ino, u8 *buf, usize cap) {
+  if (ino >= MAX_INODES || cap < (usize)DIRECT_PTRS * BLOCK_SIZE) return -1;
+  Inode *in = &inode_table[ino];
+  if (!in->used || in->is_dir) return -1;
+  u32 i = 0;
+  if (gather_blocks(in, &i, file_blocks(in), buf, DIRECT_PTRS) < 0) return -1;
+  return (ssize)in->size;
+}
+
+//write the whole content of src to fd. blocks are gathered HOSTIO_CHUNK at a time,
+//each run of adjacent blocks on the image is one pread and every chunk is one write
+ssize fs_export_fd(const char *src, int fd) {
+  const char *clean_path = src;
+  if (src[0] == '/') clean_path = src + 1;
+  u32 parent; char name[MAX_FILENAME]; u32 target;
+  if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
+  if (!target) return -1;
+  return fs_export_inode(target, fd);
+}
+
+ssize fs_export_inode(u32 ino, int fd) {
+  if (ino >= MAX_INODES) return -1;
+  Inode *in = &inode_table[ino];
+  if (!in->used || in->is_dir) return -1;
+  u8 *buf = malloc(HOSTIO_CHUNK);
+  if (!buf) return -1;
+
+  u64 size = in->size;
+  u32 nblocks = file_blocks(in);
+  u64 done = 0;
+  u32 i = 0;
+  while (i < nblocks) {
+    int filled = gather_blocks(in, &i, nblocks, buf, HOSTIO_CHUNK / BLOCK_SIZE);
+    if (filled < 0) { free(buf); return -1; }
+    usize len = (usize)filled * BLOCK_SIZE;
+    if (done + len > size) len = size - done;
+    if (host_write_all(fd, buf, len) < 0) { free(buf); return -1; }
+    done += len;
+  }
+  free(buf);
+  return (ssize)done;
+}
@@ -0,0 +1,605 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<time.h>
+
+#define IMPORT_MAX_THREADS 8
+
+typedef struct ImportNode {
+  char *host;                 // full host path 
+  char name[MAX_FILENAME];
+  int parent;                 // index into the node list, -1 for the top directory 
+  u8 is_dir;
+  u8 skip;                    // unreadable, too big or name clash 
+  u32 child_start;            // children are stored next to each other 
+  u32 child_count;
+  u8 *data;                   // file content padded to whole blocks 
+  usize size;
+  u32 ino;
+} ImportNode;
+
+typedef struct ImportList {
+  ImportNode *nodes;
+  u32 count;
+  u32 cap;
+  u32 next_file;              // work index shared by the reader threads 
+  pthread_mutex_t lock;
+} ImportList;
+
+static ImportNode* push_node(ImportList *l) {
+  if (l->count == l->cap) {
+    u32 cap = l->cap ? l->cap * 2 : 64;
+    ImportNode *n = realloc(l->nodes, sizeof(ImportNode) * cap);
+    if (!n) return NULL;
+    l->nodes = n;
+    l->cap = cap;
+  }
+  ImportNode *node = &l->nodes[l->count++];
+  memset(node, 0, sizeof(*node));
+  return node;
+}
+
+static int cmp_node_name(const void *a, const void *b) {
+  return strcmp(((const ImportNode*)a)->name, ((const ImportNode*)b)->name);
+}
+
+//breadth first walk of the host tree, children of a directory end up adjacent and sorted
+static int scan_host_tree(ImportList *l, const char *hostdir) {
+  ImportNode *top = push_node(l);
+  if (!top) return -1;
+  top->host = strdup(hostdir);
+  top->parent = -1;
+  top->is_dir = 1;
+  for (u32 d = 0; d < l->count; d++) {
+    if (!l->nodes[d].is_dir || l->nodes[d].skip) continue;
+    DIR *dir = opendir(l->nodes[d].host);
+    if (!dir) {
+      fprintf(stderr, "import: cannot open %s\n", l->nodes[d].host);
+      l->nodes[d].skip = 1;
+      continue;
+    }
+    u32 start = l->count;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+      if (strlen(de->d_name) >= MAX_FILENAME) {
+        fprintf(stderr, "import: name too long, skipped: %s/%s\n", l->nodes[d].host, de->d_name);
+        continue;
+      }
+      usize plen = strlen(l->nodes[d].host) + strlen(de->d_name) + 2;
+      char *path = malloc(plen);
+      if (!path) break;
+      snprintf(path, plen, "%s/%s", l->nodes[d].host, de->d_name);
+      int is_dir = de->d_type == DT_DIR, is_reg = de->d_type == DT_REG;
+      if (de->d_type == DT_UNKNOWN) {
+        struct stat st;
+        if (lstat(path, &st) == 0) { is_dir = S_ISDIR(st.st_mode); is_reg = S_ISREG(st.st_mode); }
+      }
+      if (!is_dir && !is_reg) { //links and devices are not representable
+        fprintf(stderr, "import: not a regular file or directory, skipped: %s\n", path);
+        free(path);
+        continue;
+      }
+      ImportNode *n = push_node(l);
+      if (!n) { free(path); break; }
+      n->host = path;
+      strcpy(n->name, de->d_name);
+      n->parent = (int)d;
+      n->is_dir = (u8)is_dir;
+    }
+    closedir(dir);
+    qsort(&l->nodes[start], l->count - start, sizeof(ImportNode), cmp_node_name);
+    l->nodes[d].child_start = start;
+    l->nodes[d].child_count = l->count - start;
+  }
+  return 0;
+}
+
+//reader thread: stat and slurp files, the whole tree fits in memory since a file is at
+//most DIRECT_PTRS blocks and the image at most MAX_INODES files
+static void* import_reader(void *arg) {
+  ImportList *l = arg;
+  for (;;) {
+    pthread_mutex_lock(&l->lock);
+    u32 i = l->next_file++;
+    pthread_mutex_unlock(&l->lock);
+    if (i >= l->count) break;
+    ImportNode *n = &l->nodes[i];
+    if (n->is_dir) continue;
+    int fd = open(n->host, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "import: cannot read %s\n", n->host);
+      n->skip = 1;
+      if (fd >= 0) close(fd);
+      continue;
+    }
+    if ((u64)st.st_size > (u64)DIRECT_PTRS * BLOCK_SIZE) {
+      fprintf(stderr, "import: %s is larger than %d bytes, skipped\n", n->host, DIRECT_PTRS * BLOCK_SIZE);
+      n->skip = 1;
+      close(fd);
+      continue;
+    }
+    usize nblocks = ((usize)st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    n->data = calloc(nblocks ? nblocks : 1, BLOCK_SIZE);
+    usize done = 0;
+    while (n->data && done < (usize)st.st_size) {
+      ssize r = read(fd, n->data + done, (usize)st.st_size - done);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) break;
+      done += (usize)r;
+    }
+    close(fd);
+    if (!n->data || done != (usize)st.st_size) {
+      fprintf(stderr, "import: short read on %s\n", n->host);
+      n->skip = 1;
+      continue;
+    }
+    n->size = done;
+  }
+  return NULL;
+}
+
+//lay out one file's data as a single run of blocks when free space allows
+static int place_file_data(Inode *in, ImportNode *n) {
+  u32 nblocks = (n->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (nblocks == 0) return 0;
+  u32 run = allocate_run(nblocks);
+  if (run) {
+    if (write_blocks(run, nblocks, n->data) != (ssize)nblocks * BLOCK_SIZE) {
+      for (u32 k = 0; k < nblocks; k++) free_block(run + k);
+      return -1;
+    }
+    for (u32 k = 0; k < nblocks; k++) in->direct[k] = run + k;
+  } else {
+    for (u32 k = 0; k < nblocks; k++) {
+      u32 b = allocate_block();
+      if (!b) return -1;
+      in->direct[k] = b;
+      write_block(b, n->data + (usize)k * BLOCK_SIZE);
+    }
+  }
+  in->size = (u32)n->size;
+  return 0;
+}
+
+//create the children of directory node d and write its entry list once
+static int import_children(ImportList *l, u32 d, long *imported) {
+  ImportNode *dn = &l->nodes[d];
+  Inode *dir = &inode_table[dn->ino];
+  usize cnt;
+  DirEntry *existing = read_dir_entries(dir, &cnt);
+  DirEntry *arr = realloc(existing, sizeof(DirEntry) * (cnt + dn->child_count + 1));
+  if (!arr) { free(existing); return -1; }
+  usize total = cnt;
+  const usize max_entries = (usize)DIRECT_PTRS * BLOCK_SIZE / sizeof(DirEntry);
+  for (u32 c = dn->child_start; c < dn->child_start + dn->child_count; c++) {
+    ImportNode *n = &l->nodes[c];
+    if (n->skip) continue;
+    int clash = 0;
+    for (usize k = 0; k < cnt; k++) {
+      if (strncmp(arr[k].name, n->name, MAX_FILENAME) == 0) { clash = 1; break; }
+    }
+    if (clash) {
+      fprintf(stderr, "import: %s already exists in the image, skipped\n", n->host);
+      n->skip = 1;
+      continue;
+    }
+    if (total >= max_entries) {
+      fprintf(stderr, "import: directory %s is full, skipped %s\n", dn->host, n->host);
+      n->skip = 1;
+      continue;
+    }
+    int ino = allocate_inode();
+    if (ino <= 0) { fprintf(stderr, "import: out of inodes at %s\n", n->host); n->skip = 1; break; }
+    Inode *in = &inode_table[ino];
+    in->is_dir = n->is_dir;
+    strncpy(in->name, n->name, MAX_FILENAME-1);
+    in->parent = dn->ino;
+    nameidx_add(ino);
+    if (!n->is_dir && place_file_data(in, n) < 0) {
+      fprintf(stderr, "import: out of space at %s\n", n->host);
+      free_inode(ino);
+      n->skip = 1;
+      break;
+    }
+    touch_inode(ino);
+    n->ino = (u32)ino;
+    memset(&arr[total], 0, sizeof(DirEntry));
+    strncpy(arr[total].name, n->name, MAX_FILENAME-1);
+    arr[total].inode_id = (u32)ino;
+    total++;
+    (*imported)++;
+  }
+  int r = total == cnt ? 0 : write_dir_entries(dir, arr, total);
+  if (r < 0) {
+    //the children never made it into the directory, take their inodes back
+    u32 *inos = malloc(sizeof(u32) * (total - cnt));
+    for (usize k = cnt; inos && k < total; k++) inos[k - cnt] = arr[k].inode_id;
+    if (inos) free_inodes(inos, total - cnt);
+    else for (usize k = cnt; k < total; k++) free_inode(arr[k].inode_id);
+    free(inos);
+    for (u32 c = dn->child_start; c < dn->child_start + dn->child_count; c++) {
+      if (!l->nodes[c].ino) continue;
+      l->nodes[c].ino = 0;
+      l->nodes[c].skip = 1;
+    }
+    *imported -= (long)(total - cnt);
+  }
+  free(arr);
+  return r;
+}
+
+//copy the host directory hostdir into the image directory dst (created if missing).
+//files are read in parallel, then every image directory is written exactly once.
+//returns the number of entries imported or -1
+long fs_import_tree(const char *hostdir, const char *dst) {
+  const char *clean_path = dst;
+  if (dst[0] == '/') clean_path = dst + 1;
+  u32 parent; char name[MAX_FILENAME]; u32 target;
+  if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
+  int was_deferred = fs_defer_sync(1);
+  if (!target && strcmp(dst, "/") != 0) {
+    int ino = fs_create_dir(dst);
+    if (ino <= 0) { fs_defer_sync(was_deferred); return -1; }
+    target = (u32)ino;
+  }
+  if (!inode_table[target].is_dir) { fs_defer_sync(was_deferred); return -1; }
+
+  ImportList l;
+  memset(&l, 0, sizeof(l));
+  pthread_mutex_init(&l.lock, NULL);
+  long imported = -1;
+  if (scan_host_tree(&l, hostdir) < 0) goto out;
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu > 0 && ncpu < IMPORT_MAX_THREADS ? (int)ncpu : IMPORT_MAX_THREADS;
+  pthread_t tids[IMPORT_MAX_THREADS];
+  int started = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (pthread_create(&tids[t], NULL, import_reader, &l) == 0) started++;
+  }
+  if (started == 0) import_reader(&l);
+  for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+  imported = 0;
+  l.nodes[0].ino = target;
+  for (u32 d = 0; d < l.count; d++) {
+    if (!l.nodes[d].is_dir || l.nodes[d].skip) continue;
+    if (d != 0 && !l.nodes[d].ino) continue;
+    if (import_children(&l, d, &imported) < 0) {
+      fprintf(stderr, "import: could not write directory for %s\n", l.nodes[d].host);
+    }
+  }
+out:
+  for (u32 i = 0; i < l.count; i++) { free(l.nodes[i].host); free(l.nodes[i].data); }
+  free(l.nodes);
+  pthread_mutex_destroy(&l.lock);
+  fs_defer_sync(was_deferred);
+  if (!was_deferred) fs_commit();
+  return imported;
+}
+
+// ---------------- export ---------------- 
+
+#define EXPORT_MAX_THREADS 8
+#define EXPORT_QUEUE_LEN 32
+#define TAR_BLOCK 512
+
+typedef struct ExportNode {
+  u32 ino;
+  char *rel;                  // path relative to the exported directory 
+} ExportNode;
+
+typedef struct ExportJob {
+  char *host;
+  u8 *data;
+  usize size;
+} ExportJob;
+
+typedef struct ExportQueue {
+  ExportJob jobs[EXPORT_QUEUE_LEN];
+  u32 head, tail, count;
+  int done;                   // producer finished, workers drain and exit 
+  long errors;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} ExportQueue;
+
+//breadth first list of everything under ino, directories come before their contents
+static ExportNode* collect_subtree(u32 ino, u32 *out_count) {
+  u32 cap = 64, count = 0;
+  ExportNode *nodes = malloc(sizeof(ExportNode) * cap);
+  if (!nodes) return NULL;
+  nodes[count].ino = ino;
+  nodes[count].rel = strdup("");
+  count++;
+  for (u32 d = 0; d < count; d++) {
+    if (!inode_table[nodes[d].ino].is_dir) continue;
+    usize cnt;
+    DirEntry *arr = read_dir_entries(&inode_table[nodes[d].ino], &cnt);
+    for (usize i = 0; i < cnt; i++) {
+      u32 child = arr[i].inode_id;
+      if (child == 0 || child >= MAX_INODES || !inode_table[child].used) continue;
+      if (count == cap) {
+        ExportNode *n = realloc(nodes, sizeof(ExportNode) * cap * 2);
+        if (!n) break;
+        nodes = n;
+        cap *= 2;
+      }
+      usize len = strlen(nodes[d].rel) + MAX_FILENAME + 2;
+      char *rel = malloc(len);
+      if (!rel) break;
+      if (nodes[d].rel[0]) snprintf(rel, len, "%s/%.*s", nodes[d].rel, MAX_FILENAME, arr[i].name);
+      else snprintf(rel, len, "%.*s", MAX_FILENAME, arr[i].name);
+      nodes[count].ino = child;
+      nodes[count].rel = rel;
+      count++;
+    }
+    free(arr);
+  }
+  *out_count = count;
+  return nodes;
+}
+
+static void free_subtree(ExportNode *nodes, u32 count) {
+  for (u32 i = 0; i < count; i++) free(nodes[i].rel);
+  free(nodes);
+}
+
+typedef struct FileOrder {
+  u32 first_block;            // UINT32_MAX for empty files so they sort last 
+  u32 node;
+} FileOrder;
+
+static int cmp_first_block(const void *a, const void *b) {
+  const FileOrder *x = a, *y = b;
+  if (x->first_block != y->first_block) return (x->first_block > y->first_block) - (x->first_block < y->first_block);
+  return (x->node > y->node) - (x->node < y->node);
+}
+
+//indexes into nodes of the files, sorted by where their data starts on the image
+static u32* files_in_disk_order(ExportNode *nodes, u32 count, u32 *out_files) {
+  FileOrder *fo = malloc(sizeof(FileOrder) * (count ? count : 1));
+  u32 *order = malloc(sizeof(u32) * (count ? count : 1));
+  if (!fo || !order) { free(fo); free(order); return NULL; }
+  u32 n = 0;
+  for (u32 i = 0; i < count; i++) {
+    Inode *in = &inode_table[nodes[i].ino];
+    if (in->is_dir) continue;
+    fo[n].first_block = in->direct[0] ? in->direct[0] : UINT32_MAX;
+    fo[n].node = i;
+    n++;
+  }
+  qsort(fo, n, sizeof(FileOrder), cmp_first_block);
+  for (u32 i = 0; i < n; i++) order[i] = fo[i].node;
+  free(fo);
+  *out_files = n;
+  return order;
+}
+
+static void* export_writer(void *arg) {
+  ExportQueue *q = arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->done) pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count == 0) { pthread_mutex_unlock(&q->lock); break; }
+    ExportJob job = q->jobs[q->head];
+    q->head = (q->head + 1) % EXPORT_QUEUE_LEN;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+
+    int fd = open(job.host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int bad = fd < 0 || host_write_all(fd, job.data, job.size) < 0;
+    if (fd >= 0 && close(fd) < 0) bad = 1;
+    if (bad) {
+      fprintf(stderr, "export: cannot write %s\n", job.host);
+      pthread_mutex_lock(&q->lock);
+      q->errors++;
+      pthread_mutex_unlock(&q->lock);
+    }
+    free(job.host);
+    free(job.data);
+  }
+  return NULL;
+}
+
+static char* host_join(const char *hostdir, const char *rel) {
+  usize len = strlen(hostdir) + strlen(rel) + 2;
+  char *p = malloc(len);
+  if (p) snprintf(p, len, "%s/%s", hostdir, rel);
+  return p;
+}
+
+static int resolve_dir(const char *src, u32 *out) {
+  if (strcmp(src, "/") == 0) { *out = 0; return 0; }
+  const char *clean_path = src;
+  if (src[0] == '/') clean_path = src + 1;
+  u32 parent; char name[MAX_FILENAME]; u32 target;
+  if (resolve_path(clean_path, 1, &parent, name, &target) < 0) return -1;
+  if (!target || !inode_table[target].is_dir) return -1;
+  *out = target;
+  return 0;
+}
+
+//copy the image directory src into hostdir. data is read from the image strictly in
+//on-image order while a pool of writer threads creates the host files
+long fs_export_tree(const char *src, const char *hostdir) {
+  u32 top;
+  if (resolve_dir(src, &top) < 0) return -1;
+  u32 count, nfiles;
+  ExportNode *nodes = collect_subtree(top, &count);
+  if (!nodes) return -1;
+  u32 *order = files_in_disk_order(nodes, count, &nfiles);
+  if (!order) { free_subtree(nodes, count); return -1; }
+
+  long exported = 0;
+  if (mkdir(hostdir, 0755) < 0 && errno != EEXIST) goto fail;
+  for (u32 i = 1; i < count; i++) {
+    if (!inode_table[nodes[i].ino].is_dir) continue;
+    char *p = host_join(hostdir, nodes[i].rel);
+    if (!p || (mkdir(p, 0755) < 0 && errno != EEXIST)) {
+      fprintf(stderr, "export: cannot create %s\n", p ? p : nodes[i].rel);
+      free(p);
+      goto fail;
+    }
+    free(p);
+    exported++;
+  }
+
+  ExportQueue q;
+  memset(&q, 0, sizeof(q));
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.not_empty, NULL);
+  pthread_cond_init(&q.not_full, NULL);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu > 0 && ncpu < EXPORT_MAX_THREADS ? (int)ncpu : EXPORT_MAX_THREADS;
+  pthread_t tids[EXPORT_MAX_THREADS];
+  int started = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (pthread_create(&tids[t], NULL, export_writer, &q) == 0) started++;
+  }
+
+  for (u32 k = 0; k < nfiles; k++) {
+    ExportNode *n = &nodes[order[k]];
+    ExportJob job;
+    job.host = host_join(hostdir, n->rel);
+    job.data = malloc((usize)DIRECT_PTRS * BLOCK_SIZE);
+    ssize len = job.data ? fs_read_inode_raw(n->ino, job.data, (usize)DIRECT_PTRS * BLOCK_SIZE) : -1;
+    if (!job.host || len < 0) {
+      fprintf(stderr, "export: cannot read /%s\n", n->rel);
+      free(job.host); free(job.data);
+      pthread_mutex_lock(&q.lock); //writers bump errors too
+      q.errors++;
+      pthread_mutex_unlock(&q.lock);
+      continue;
+    }
+    job.size = (usize)len;
+    if (started == 0) { //no threads, write inline
+      int fd = open(job.host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || host_write_all(fd, job.data, job.size) < 0) {
+        pthread_mutex_lock(&q.lock);
+        q.errors++;
+        pthread_mutex_unlock(&q.lock);
+      }
+      if (fd >= 0) close(fd);
+      free(job.host); free(job.data);
+    } else {
+      pthread_mutex_lock(&q.lock);
+      while (q.count == EXPORT_QUEUE_LEN) pthread_cond_wait(&q.not_full, &q.lock);
+      q.jobs[q.tail] = job;
+      q.tail = (q.tail + 1) % EXPORT_QUEUE_LEN;
+      q.count++;
+      pthread_cond_signal(&q.not_empty);
+      pthread_mutex_unlock(&q.lock);
+    }
+    exported++;
+  }
+  pthread_mutex_lock(&q.lock);
+  q.done = 1;
+  pthread_cond_broadcast(&q.not_empty);
+  pthread_mutex_unlock(&q.lock);
+  for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+  pthread_mutex_destroy(&q.lock);
+  pthread_cond_destroy(&q.not_empty);
+  pthread_cond_destroy(&q.not_full);
+
+  free(order);
+  free_subtree(nodes, count);
+  return q.errors ? -1 : exported;
+fail:
+  free(order);
+  free_subtree(nodes, count);
+  return -1;
+}
+
+//ustar header for one entry, long paths are split into prefix/name
+static int tar_header(u8 *hdr, const char *rel, int is_dir, u64 size) {
+  memset(hdr, 0, TAR_BLOCK);
+  usize len = strlen(rel);
+  const char *name = rel;
+  if (len > 100) {
+    //find a slash that leaves <= 155 bytes of prefix and <= 100 of name
+    const char *cut = NULL;
+    for (const char *p = rel; *p; p++) {
+      if (*p == '/' && (usize)(p - rel) <= 155 && len - (usize)(p - rel) - 1 <= 100) { cut = p; break; }
+    }
+    if (!cut) return -1;
+    memcpy(hdr + 345, rel, (usize)(cut - rel));
+    name = cut + 1;
+  }
+  memcpy(hdr, name, strlen(name));
+  snprintf((char*)hdr + 100, 8, "%07o", is_dir ? 0755 : 0644);
+  snprintf((char*)hdr + 108, 8, "%07o", (unsigned)getuid());
+  snprintf((char*)hdr + 116, 8, "%07o", (unsigned)getgid());
+  snprintf((char*)hdr + 124, 12, "%011llo", (unsigned long long)size);
+  snprintf((char*)hdr + 136, 12, "%011llo", (unsigned long long)time(NULL));
+  hdr[156] = is_dir ? '5' : '0';
+  memcpy(hdr + 257, "ustar", 6);
+  memcpy(hdr + 263, "00", 2);
+  memset(hdr + 148, ' ', 8); //checksum is computed with its own field as spaces
+  unsigned sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++) sum += hdr[i];
+  snprintf((char*)hdr + 148, 8, "%06o", sum);
+  hdr[155] = ' ';
+  return 0;
+}
+
+//write the image directory src as a ustar stream: directories first, then the files
+//in on-image order so the image is read front to back
+long fs_export_tar(const char *src, int fd) {
+  u32 top;
+  if (resolve_dir(src, &top) < 0) return -1;
+  u32 count, nfiles;
+  ExportNode *nodes = collect_subtree(top, &count);
+  if (!nodes) return -1;
+  u32 *order = files_in_disk_order(nodes, count, &nfiles);
+  if (!order) { free_subtree(nodes, count); return -1; }
+
+  u8 hdr[TAR_BLOCK];
+  long exported = 0;
+  for (u32 i = 1; i < count; i++) {
+    if (!inode_table[nodes[i].ino].is_dir) continue;
+    char *rel = host_join(nodes[i].rel, "");  // directories end in a slash 
+    if (!rel || tar_header(hdr, rel, 1, 0) < 0) {
+      fprintf(stderr, "export: path too long for tar, skipped: /%s\n", nodes[i].rel);
+      free(rel);
+      continue;
+    }
+    free(rel);
+    if (host_write_all(fd, hdr, TAR_BLOCK) < 0) goto fail;
+    exported++;
+  }
+  for (u32 k = 0; k < nfiles; k++) {
+    ExportNode *n = &nodes[order[k]];
+    u32 size = inode_table[n->ino].size;
+    if (tar_header(hdr, n->rel, 0, size) < 0) {
+      fprintf(stderr, "export: path too long for tar, skipped: /%s\n", n->rel);
+      continue;
+    }
+    if (host_write_all(fd, hdr, TAR_BLOCK) < 0) goto fail;
+    if (fs_export_inode(n->ino, fd) != (ssize)size) goto fail;
+    usize pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    memset(hdr, 0, TAR_BLOCK);
+    if (pad && host_write_all(fd, hdr, pad) < 0) goto fail;
+    exported++;
+  }
+  //end of archive is two zero blocks
+  memset(hdr, 0, TAR_BLOCK);
+  if (host_write_all(fd, hdr, TAR_BLOCK) < 0 || host_write_all(fd, hdr, TAR_BLOCK) < 0) goto fail;
+  free(order);
+  free_subtree(nodes, count);
+  return exported;
+fail:
+  free(order);
+  free_subtree(nodes, count);
+  return -1;
+}
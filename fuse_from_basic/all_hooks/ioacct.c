@@ -0,0 +1,163 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+
+// disk i/o accounting. every thread bumps its own counters with no sharing, readers
+// sum over the live threads plus what exited threads left behind. reset does not touch
+// other threads' memory, it snapshots the sums and later dumps report the difference
+typedef struct IoCat {
+  u64 preads;
+  u64 pwrites;
+  u64 bytes_read;
+  u64 bytes_written;
+  u64 short_ios;   // a pread/pwrite that moved fewer bytes than asked 
+} IoCat;
+
+typedef struct IoThread {
+  IoCat cat[IO_CAT_COUNT];
+  u64 fsyncs;
+  struct IoThread *next;
+} IoThread;
+
+static const char *cat_names[IO_CAT_COUNT] = { "super", "inodes", "bitmap", "index", "dir", "data" };
+
+static __thread IoThread *mine;
+static __thread int data_hint = IO_CAT_DATA;
+static IoThread *all_threads;
+static IoThread retired;   // folded in counters of threads that exited 
+static IoThread baseline;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+static void add_counters(IoThread *out, IoThread *t) {
+  for (int k = 0; k < IO_CAT_COUNT; k++) {
+    out->cat[k].preads += __atomic_load_n(&t->cat[k].preads, __ATOMIC_RELAXED);
+    out->cat[k].pwrites += __atomic_load_n(&t->cat[k].pwrites, __ATOMIC_RELAXED);
+    out->cat[k].bytes_read += __atomic_load_n(&t->cat[k].bytes_read, __ATOMIC_RELAXED);
+    out->cat[k].bytes_written += __atomic_load_n(&t->cat[k].bytes_written, __ATOMIC_RELAXED);
+    out->cat[k].short_ios += __atomic_load_n(&t->cat[k].short_ios, __ATOMIC_RELAXED);
+  }
+  out->fsyncs += __atomic_load_n(&t->fsyncs, __ATOMIC_RELAXED);
+}
+
+//fuse starts and stops worker threads all the time, an exiting thread hands its
+//counts to the retired totals so the list only holds live threads
+static void thread_exit(void *arg) {
+  IoThread *t = arg;
+  pthread_mutex_lock(&threads_lock);
+  add_counters(&retired, t);
+  for (IoThread **pp = &all_threads; *pp; pp = &(*pp)->next) {
+    if (*pp == t) { *pp = t->next; break; }
+  }
+  pthread_mutex_unlock(&threads_lock);
+  mine = NULL;
+  free(t);
+}
+
+static void make_exit_key(void) {
+  pthread_key_create(&exit_key, thread_exit);
+}
+
+static IoThread* my_counters(void) {
+  if (mine) return mine;
+  IoThread *t = calloc(1, sizeof(IoThread));
+  if (!t) return NULL;
+  pthread_once(&exit_key_once, make_exit_key);
+  pthread_mutex_lock(&threads_lock);
+  t->next = all_threads;
+  all_threads = t;
+  pthread_mutex_unlock(&threads_lock);
+  pthread_setspecific(exit_key, t);
+  mine = t;
+  return t;
+}
+
+//only the owner writes, so a relaxed load and store is enough
+static inline void bump(u64 *c, u64 by) {
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+int io_set_category(int cat) {
+  int prev = data_hint;
+  data_hint = cat;
+  return prev;
+}
+
+//metadata regions are known from the superblock, data blocks use the caller's hint
+static int category_of(off_t off) {
+  u64 b = (u64)off / BLOCK_SIZE;
+  if (b == 0) return IO_CAT_SUPER;
+  if (b >= sb.inode_table_block && b < sb.block_bitmap_block) return IO_CAT_INODES;
+  if (b >= sb.block_bitmap_block && b < sb.data_block_start) return IO_CAT_BITMAP;
+  if (sb.refcount_block && b >= sb.refcount_block && b < (u64)sb.refcount_block + REFCOUNT_BLOCKS) return IO_CAT_INDEX;
+  if (sb.name_index_block && b >= sb.name_index_block && b < (u64)sb.name_index_block + NAME_INDEX_BLOCKS) return IO_CAT_INDEX;
+  return data_hint;
+}
+
+void io_account(int is_write, off_t off, usize asked, ssize got) {
+  IoThread *t = my_counters();
+  if (!t) return;
+  IoCat *c = &t->cat[category_of(off)];
+  bump(is_write ? &c->pwrites : &c->preads, 1);
+  if (got > 0) bump(is_write ? &c->bytes_written : &c->bytes_read, (u64)got);
+  if (got >= 0 && (usize)got < asked) bump(&c->short_ios, 1);
+}
+
+void io_account_fsync(void) {
+  IoThread *t = my_counters();
+  if (t) bump(&t->fsyncs, 1);
+}
+
+void io_thread_totals(u64 *ios, u64 *fsyncs) {
+  *ios = 0;
+  *fsyncs = 0;
+  if (!mine) return;
+  for (int k = 0; k < IO_CAT_COUNT; k++) *ios += mine->cat[k].preads + mine->cat[k].pwrites;
+  *fsyncs = mine->fsyncs;
+}
+
+static void io_sum(IoThread *out) {
+  pthread_mutex_lock(&threads_lock);
+  *out = retired;
+  out->next = NULL;
+  for (IoThread *t = all_threads; t; t = t->next) add_counters(out, t);
+  pthread_mutex_unlock(&threads_lock);
+}
+
+//text dump, one line per category plus the fsync count. returns the full length
+usize io_format(char *buf, usize cap) {
+  IoThread s;
+  io_sum(&s);
+  pthread_mutex_lock(&threads_lock);
+  IoThread base = baseline;
+  pthread_mutex_unlock(&threads_lock);
+  usize len = 0;
+  int n = snprintf(buf, cap, "# io category preads pwrites bytes_read bytes_written short_ios\n");
+  if (n > 0) len += (usize)n;
+  for (int k = 0; k < IO_CAT_COUNT; k++) {
+    const IoCat *c = &s.cat[k], *b = &base.cat[k];
+    n = snprintf(len < cap ? buf + len : NULL, len < cap ? cap - len : 0,
+                 "io_%s %llu %llu %llu %llu %llu\n", cat_names[k],
+                 (unsigned long long)(c->preads - b->preads),
+                 (unsigned long long)(c->pwrites - b->pwrites),
+                 (unsigned long long)(c->bytes_read - b->bytes_read),
+                 (unsigned long long)(c->bytes_written - b->bytes_written),
+                 (unsigned long long)(c->short_ios - b->short_ios));
+    if (n > 0) len += (usize)n;
+  }
+  n = snprintf(len < cap ? buf + len : NULL, len < cap ? cap - len : 0,
+               "io_fsync %llu\n", (unsigned long long)(s.fsyncs - base.fsyncs));
+  if (n > 0) len += (usize)n;
+  return len;
+}
+
+void io_reset(void) {
+  IoThread s;
+  io_sum(&s);
+  pthread_mutex_lock(&threads_lock);
+  baseline = s;
+  pthread_mutex_unlock(&threads_lock);
+}
@@ -2,9 +2,135 @@
 #include <stdio.h>
 #include<stdlib.h>
 #include<string.h>
-#define Read_buff_size 65536
+#include<fcntl.h>
+#include<errno.h>
+#define BATCH_MAX_ARGS 8
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [mkdir <path> | touch <path> | rename <old_path> <new_path> | clone <src> <dst> | ls [-l] | find [-g|-s] <pattern> | reindex\nrm <path> | write <path> <src|-> | read <path> [dst] | import <hostdir> <path> | export <path> <hostdir|-> | batch [-n <ops>] [script|-] | iostat <command> | format [-l]]\n", prog);
+}
+
+//set while a batch script is read from stdin, "-" cannot be a data source then
+static int stdin_is_script;
+
+//run one command, argv[0] is the verb. returns 0 ok, -1 failed, -2 bad usage
+static int run_command(int argc, char **argv) {
+    if (strcmp(argv[0], "mkdir") == 0 && argc==2) {
+      if (fs_create_dir(argv[1])>0) { printf("mkdir %s\n", argv[1]); return 0; }
+    } else if (strcmp(argv[0], "touch") == 0 && argc==2){
+      if (fs_create_file(argv[1])>0) { printf("touch %s\n",argv[1]); return 0; }
+    } else if (strcmp(argv[0], "rm") == 0 && argc==2){
+      if (fs_unlink(argv[1]) == 0) { printf("rm %s\n",argv[1]); return 0; }
+    }else if (strcmp(argv[0], "rename") == 0 && argc==3){
+      if (fs_rename(argv[1],argv[2]) == 0) { printf("rename %s to %s \n",argv[1],argv[2]); return 0; }
+    }else if (strcmp(argv[0], "clone") == 0 && argc==3){
+      if (fs_clone_file(argv[1],argv[2]) > 0) { printf("clone %s to %s\n",argv[1],argv[2]); return 0; }
+    }else if (strcmp(argv[0], "ls") == 0 && (argc == 1 || (argc == 2 && strcmp(argv[1], "-l") == 0))) {
+      //-l adds type and size, both come straight from the inode
+      if (fs_list_tree(0, argc == 2) == 0) return 0;
+    }else if (strcmp(argv[0], "find") == 0 && argc == 2) {
+      fs_find_paths(argv[1]);
+      return 0;
+    }else if (strcmp(argv[0], "find") == 0 && argc == 3 && strcmp(argv[1], "-g") == 0) {
+      fs_find_glob(argv[2]);
+      return 0;
+    }else if (strcmp(argv[0], "find") == 0 && argc == 3 && strcmp(argv[1], "-s") == 0) {
+      fs_find_substring(argv[2]);
+      return 0;
+    }else if (strcmp(argv[0], "reindex") == 0 && argc == 1) {
+      if (nameidx_rebuild() == 0) { printf("name index rebuilt\n"); return 0; }
+    }else if (strcmp(argv[0], "write") == 0 && argc==3) {
+      //streamed in chunks, "-" reads the data from stdin
+      if (strcmp(argv[2], "-") == 0 && stdin_is_script) {
+        fprintf(stderr, "write: stdin is the batch script, give a file as the source\n");
+        return -1;
+      }
+      int fd = strcmp(argv[2], "-") == 0 ? STDIN_FILENO : open(argv[2], O_RDONLY);
+      if (fd < 0) { perror("open src"); return -1; }
+      ssize L = fs_import_fd(fd, argv[1]);
+      if (fd != STDIN_FILENO) close(fd);
+      if (L >= 0) { printf("wrote %zd bytes to %s\n", L, argv[1]); return 0; }
+      if (L == -EFBIG) { printf("%s is larger than the %u byte file limit\n", argv[2], DIRECT_PTRS * BLOCK_SIZE); return -1; }
+    }
+    else if (strcmp(argv[0], "read") == 0 && (argc==2 || argc==3)) {
+      //raw bytes to stdout or to a host file, no size cap
+      int fd = STDOUT_FILENO;
+      if (argc == 3) fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) { perror("open dst"); return -1; }
+      fflush(stdout); //keep our own messages ahead of the file data
+      ssize_t r = fs_export_fd(argv[1], fd);
+      if (fd != STDOUT_FILENO) close(fd);
+      if (r >= 0) return 0;
+    }else if (strcmp(argv[0], "import") == 0 && argc==3) {
+      long n = fs_import_tree(argv[1], argv[2]);
+      if (n >= 0) { printf("imported %ld entries from %s to %s\n", n, argv[1], argv[2]); return 0; }
+    }else if (strcmp(argv[0], "export") == 0 && argc==3) {
+      //"-" writes a tar stream to stdout
+      long n;
+      if (strcmp(argv[2], "-") == 0) { fflush(stdout); n = fs_export_tar(argv[1], STDOUT_FILENO); }
+      else n = fs_export_tree(argv[1], argv[2]);
+      if (n >= 0) { fprintf(stderr, "exported %ld entries from %s\n", n, argv[1]); return 0; }
+    }else if (strcmp(argv[0], "rm") == 0 && argc==3 && strcmp(argv[1], "-r")==0) {
+      if (fs_delete_dir_recursive(argv[2])==0) { printf("rm -r %s done\n", argv[2]); return 0; }
+    }else {
+      return -2;
+    }
+    return -1;
+}
+
+//i/o counters go to stderr so they never mix with data streamed to stdout
+static void dump_io(void) {
+    char buf[1024];
+    io_format(buf, sizeof(buf));
+    fputs(buf, stderr);
+}
+
+//read commands one per line from script ("-" for stdin) and run them against the
+//already loaded fs. metadata is only written every commit_every ops (0 = at the end)
+static int run_batch(const char *script, long commit_every) {
+    FILE *in = stdin;
+    if (strcmp(script, "-") != 0) {
+      in = fopen(script, "r");
+      if (!in) { perror("open script"); return 1; }
+    }
+    stdin_is_script = in == stdin;
+    fs_defer_sync(1);
+    char line[4096];
+    long lineno = 0, ops = 0, failed = 0;
+    while (fgets(line, sizeof(line), in)) {
+      lineno++;
+      char *args[BATCH_MAX_ARGS];
+      int n = 0;
+      char *save = NULL;
+      for (char *tok = strtok_r(line, " \t\r\n", &save); tok && n < BATCH_MAX_ARGS; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        args[n++] = tok;
+      }
+      if (n == 0 || args[0][0] == '#') continue; //blank line or comment
+      int r = run_command(n, args);
+      if (r == -2) fprintf(stderr, "batch: line %ld: unknown command or incorrect arguments\n", lineno);
+      if (r < 0) { failed++; continue; }
+      ops++;
+      if (commit_every > 0 && ops % commit_every == 0) fs_commit();
+    }
+    if (in != stdin) fclose(in);
+    fs_defer_sync(0);
+    if (fs_commit() < 0) { fprintf(stderr, "batch: final commit failed\n"); return 1; }
+    printf("batch: %ld ops done, %ld failed\n", ops, failed);
+    return failed ? 1 : 0;
+}
 
 int main(int argc,char **argv) {
+    //"iostat <command>" runs the command and then dumps the disk i/o it caused
+    int iostat = argc >= 3 && strcmp(argv[1], "iostat") == 0;
+    if (iostat) { argv[1] = argv[0]; argv++; argc--; }
+    //"format [-l]" replaces the image, -l leaves the inode table sparse until first sync
+    if (argc >= 2 && strcmp(argv[1], "format") == 0) {
+      if (argc > 3 || (argc == 3 && strcmp(argv[2], "-l") != 0)) { print_usage(argv[0]); return 1; }
+      if (format_fs_opts(argc == 3 ? FORMAT_LAZY_ITABLE : 0) < 0) { printf("format failed\n"); return 1; }
+      printf("formatted %s\n", DISK_PATH);
+      if (iostat) dump_io();
+      return 0;
+    }
     if (access(DISK_PATH, F_OK) != 0) {
         printf("Formatting new filesystem...\n");
         if (format_fs() < 0) {
@@ -16,44 +142,41 @@ int main(int argc,char **argv) {
 	    printf("failed to load the fs");
 	    return 1;
     }
+    if (iostat) io_reset(); //count the command only, not loading the image
 
-    printf("Loaded filesystem.\n");
-    fs_info();
+    //read/export to stdout stream raw data, keep the banner out of it
+    int data_on_stdout = argc >= 3 && ((strcmp(argv[1], "read") == 0 && argc == 3) ||
+                                       (strcmp(argv[1], "export") == 0 && argc == 4 && strcmp(argv[3], "-") == 0));
+    if (!data_on_stdout) {
+      printf("Loaded filesystem.\n");
+      fs_info();
+    }
     if(argc==1){
       printf("No arguments Given\n");
-      printf("Usage: [mkdir <path> | touch <path> | rename <old_path> <new_path> | ls | find <filename> | rm <path>]\n");
+      printf("Usage: [mkdir <path> | touch <path> | rename <old_path> <new_path> | clone <src> <dst> | ls [-l] | find [-g|-s] <pattern> | reindex | rm <path> | write <path> <src|-> | read <path> [dst] | import <hostdir> <path> | export <path> <hostdir|-> | batch [-n <ops>] [script|-] | iostat <command> | format [-l]]\n");
     }
     if(argc >=2 ){
-      if (strcmp(argv[1], "mkdir") == 0 && argc==3) {
-        if (fs_create_dir(argv[2])>0) printf("mkdir %s\n", argv[2]);
-      } else if (strcmp(argv[1], "touch") == 0 && argc==3){
-        if (fs_create_file(argv[2])>0) printf("touch %s\n",argv[2]);
-      } else if (strcmp(argv[1], "rm") == 0 && argc==3){
-        if (fs_unlink(argv[2]) == 0) printf("rm %s\n",argv[2]);
-      }else if (strcmp(argv[1], "rename") == 0 && argc==4){
-        if (fs_rename(argv[2],argv[3]) == 0) printf("rename %s to %s \n",argv[2],argv[3]);
-      }else if (strcmp(argv[1], "ls") == 0) {
-        fs_list_dir_recursive(0,0);
-      }else if (strcmp(argv[1], "find") == 0 && argc == 3) {
-        fs_find_paths(argv[2]);
-      }else if (strcmp(argv[1], "write") == 0 && argc==4) {
-        FILE *f = fopen(argv[3], "rb"); if (!f) { perror("open src"); return 1; }
-        fseek(f,0,SEEK_END); long L = ftell(f); fseek(f,0,SEEK_SET);
-        uint8_t *buf = malloc(L);
-        fread(buf,1,L,f); fclose(f);
-        if (fs_write_file(argv[2], buf, L) > 0) printf("wrote %ld bytes to %s\n", L, argv[2]);
-        free(buf);
+      if (strcmp(argv[1], "batch") == 0) {
+        long every = 0;
+        int i = 2;
+        if (i < argc && strcmp(argv[i], "-n") == 0) {
+          char *end = NULL;
+          if (i + 1 < argc) every = strtol(argv[i+1], &end, 10);
+          if (!end || end == argv[i+1] || *end || every < 0) { print_usage(argv[0]); unload_fs(); return 1; }
+          i += 2;
+        }
+        if (i < argc - 1) { print_usage(argv[0]); unload_fs(); return 1; }
+        int r = run_batch(i < argc ? argv[i] : "-", every);
+        unload_fs();
+        if (iostat) dump_io();
+        return r;
       }
-      else if (strcmp(argv[1], "read") == 0 && argc==3) {
-        uint8_t buf[Read_buff_size]; 
-        ssize_t r = fs_read_file(argv[2], buf, sizeof(buf));
-        if (r>0) printf("%.*s", (int)r, buf);
-      }else if (strcmp(argv[1], "rm") == 0 && argc==4 && strcmp(argv[2], "-r")==0) { 
-        if (fs_delete_dir_recursive(argv[3])==0) printf("rm -r %s done\n", argv[3]);
-      }else {
+      if (run_command(argc - 1, argv + 1) == -2) {
         printf("Unknown command or incorrect arguments.\n");
-        printf("Usage: %s [mkdir <path> | touch <path> | rename <old_path> <new_path> | ls | find <filename>\nrm <path>]\n", argv[0]);
+        print_usage(argv[0]);
       }
     }
+    unload_fs(); //marks the image clean so the next run skips the counter rebuild
+    if (iostat) dump_io();
     return 0;
 }
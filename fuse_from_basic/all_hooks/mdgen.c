@@ -0,0 +1,259 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<pthread.h>
+#include<sys/stat.h>
+
+// metadata workload generator in the spirit of mdtest. every thread builds its own
+// tree /<root>/t<k> with the given fan-out and depth and files_per_dir files in each
+// directory, then the phases below run in lock step behind a barrier:
+//   dir_create file_create file_stat file_rename file_remove dir_remove
+// against the core api on ./virtual_disk.img (default) or any mounted path (-m),
+// e.g. the fuse mount. one csv row per phase: phase,ops,errors,seconds,ops_per_sec
+
+typedef struct Backend {
+  int (*mkdir)(const char *path);
+  int (*create)(const char *path);
+  int (*stat)(const char *path);
+  int (*rename)(const char *from, const char *to);
+  int (*unlink)(const char *path);
+  int (*rmdir)(const char *path);
+} Backend;
+
+// ---- core api, the core is single threaded so every call holds core_lock ----
+
+static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int core_mkdir(const char *p) {
+  pthread_mutex_lock(&core_lock);
+  int r = fs_create_dir(p) > 0 ? 0 : -1;
+  pthread_mutex_unlock(&core_lock);
+  return r;
+}
+static int core_create(const char *p) {
+  pthread_mutex_lock(&core_lock);
+  int r = fs_create_file(p) > 0 ? 0 : -1;
+  pthread_mutex_unlock(&core_lock);
+  return r;
+}
+static int core_stat(const char *p) {
+  u32 parent, target;
+  char name[MAX_FILENAME];
+  pthread_mutex_lock(&core_lock);
+  int r = resolve_path(p[0] == '/' ? p + 1 : p, 1, &parent, name, &target);
+  if (r == 0 && !target) r = -1;
+  pthread_mutex_unlock(&core_lock);
+  return r;
+}
+static int core_rename(const char *a, const char *b) {
+  pthread_mutex_lock(&core_lock);
+  int r = fs_rename(a, b);
+  pthread_mutex_unlock(&core_lock);
+  return r;
+}
+static int core_unlink(const char *p) {
+  pthread_mutex_lock(&core_lock);
+  int r = fs_unlink(p);
+  pthread_mutex_unlock(&core_lock);
+  return r;
+}
+
+static const Backend core_backend = { core_mkdir, core_create, core_stat, core_rename, core_unlink, core_unlink };
+
+// ---- plain posix calls under a mount point ----
+
+static int posix_mkdir(const char *p) { return mkdir(p, 0755); }
+static int posix_create(const char *p) {
+  int fd = open(p, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) return -1;
+  close(fd);
+  return 0;
+}
+static int posix_stat(const char *p) { struct stat st; return stat(p, &st); }
+static int posix_rename(const char *a, const char *b) { return rename(a, b); }
+static int posix_unlink(const char *p) { return unlink(p); }
+static int posix_rmdir(const char *p) { return rmdir(p); }
+
+static const Backend posix_backend = { posix_mkdir, posix_create, posix_stat, posix_rename, posix_unlink, posix_rmdir };
+
+// ---- workload ----
+
+enum { PH_DIR_CREATE, PH_FILE_CREATE, PH_FILE_STAT, PH_FILE_RENAME, PH_FILE_REMOVE, PH_DIR_REMOVE, PH_COUNT };
+static const char *phase_names[PH_COUNT] = {
+  "dir_create", "file_create", "file_stat", "file_rename", "file_remove", "dir_remove"
+};
+
+typedef struct Config {
+  const Backend *be;
+  const char *root;    // tree root, "/mdgen" inside the image or <mount>/mdgen
+  u32 threads;
+  u32 fanout;
+  u32 depth;
+  u32 files_per_dir;
+  int defer;           // core only: commit metadata once per phase
+} Config;
+
+typedef struct Worker {
+  const Config *cfg;
+  u32 id;
+  char **dirs;         // own tree in breadth first order, dirs[0] is t<id>
+  usize ndirs;
+  u64 ops[PH_COUNT];
+  u64 errors[PH_COUNT];
+} Worker;
+
+static pthread_barrier_t phase_start, phase_end;
+static Config cfg = { &core_backend, NULL, 1, 4, 2, 16, 0 };
+
+//all directory paths of one thread's tree, parents before children
+static char** build_tree(const Config *c, u32 id, usize *out_n) {
+  usize total = 1, level = 1;
+  for (u32 d = 0; d < c->depth; d++) { level *= c->fanout; total += level; }
+  char **dirs = calloc(total, sizeof(char*));
+  if (!dirs) return NULL;
+  usize n = 0;
+  dirs[n] = malloc(strlen(c->root) + 16);
+  if (!dirs[n]) { free(dirs); return NULL; }
+  sprintf(dirs[n++], "%s/t%u", c->root, id);
+  //dirs doubles as the bfs queue, only the last level has no children
+  usize inner = total - level;
+  for (usize q = 0; q < inner; q++) {
+    for (u32 k = 0; k < c->fanout; k++) {
+      dirs[n] = malloc(strlen(dirs[q]) + 16);
+      if (!dirs[n]) { *out_n = n; return dirs; }
+      sprintf(dirs[n++], "%s/d%u", dirs[q], k);
+    }
+  }
+  *out_n = n;
+  return dirs;
+}
+
+static void run_phase(Worker *w, int ph) {
+  const Backend *be = w->cfg->be;
+  char path[4096], to[4096];
+  u64 ok = 0, bad = 0;
+  if (ph == PH_DIR_CREATE) {
+    for (usize i = 0; i < w->ndirs; i++) (be->mkdir(w->dirs[i]) == 0) ? ok++ : bad++;
+  } else if (ph == PH_DIR_REMOVE) {
+    for (usize i = w->ndirs; i-- > 0; ) (be->rmdir(w->dirs[i]) == 0) ? ok++ : bad++;
+  } else {
+    for (usize i = 0; i < w->ndirs; i++) {
+      for (u32 f = 0; f < w->cfg->files_per_dir; f++) {
+        snprintf(path, sizeof(path), "%s/f%u", w->dirs[i], f);
+        snprintf(to, sizeof(to), "%s/r%u", w->dirs[i], f);
+        int r = -1;
+        switch (ph) {
+          case PH_FILE_CREATE: r = be->create(path); break;
+          case PH_FILE_STAT:   r = be->stat(path); break;
+          case PH_FILE_RENAME: r = be->rename(path, to); break;
+          case PH_FILE_REMOVE: r = be->unlink(to); break;
+        }
+        (r == 0) ? ok++ : bad++;
+      }
+    }
+  }
+  w->ops[ph] = ok;
+  w->errors[ph] = bad;
+}
+
+static void* worker_main(void *arg) {
+  Worker *w = arg;
+  //deferral is per thread, main commits once every worker is through the phase
+  if (w->cfg->defer && w->cfg->be == &core_backend) fs_defer_sync(1);
+  for (int ph = 0; ph < PH_COUNT; ph++) {
+    pthread_barrier_wait(&phase_start);
+    run_phase(w, ph);
+    pthread_barrier_wait(&phase_end);
+  }
+  return NULL;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-m mountdir] [-t threads] [-f fanout] [-d depth] [-n files_per_dir] [-D]\n"
+                  "  without -m the core api runs on ./%s, -D commits its metadata once per phase\n",
+          prog, DISK_PATH);
+}
+
+int main(int argc, char **argv) {
+  const char *mount = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-D") == 0) { cfg.defer = 1; continue; }
+    if (i + 1 >= argc) { usage(argv[0]); return 1; }
+    if (strcmp(argv[i], "-m") == 0) mount = argv[++i];
+    else if (strcmp(argv[i], "-t") == 0) cfg.threads = (u32)atoi(argv[++i]);
+    else if (strcmp(argv[i], "-f") == 0) cfg.fanout = (u32)atoi(argv[++i]);
+    else if (strcmp(argv[i], "-d") == 0) cfg.depth = (u32)atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0) cfg.files_per_dir = (u32)atoi(argv[++i]);
+    else { usage(argv[0]); return 1; }
+  }
+  if (cfg.threads == 0 || cfg.fanout == 0) { usage(argv[0]); return 1; }
+
+  char root[4096];
+  if (mount) {
+    cfg.be = &posix_backend;
+    snprintf(root, sizeof(root), "%s/mdgen", mount);
+  } else {
+    if (access(DISK_PATH, F_OK) != 0 && format_fs() < 0) { fprintf(stderr, "mdgen: format failed\n"); return 1; }
+    if (load_fs() < 0) { fprintf(stderr, "mdgen: cannot load %s\n", DISK_PATH); return 1; }
+    snprintf(root, sizeof(root), "/mdgen");
+  }
+  cfg.root = root;
+  if (cfg.be->mkdir(root) < 0 && cfg.be->stat(root) < 0) {
+    fprintf(stderr, "mdgen: cannot create %s\n", root);
+    return 1;
+  }
+
+  Worker *ws = calloc(cfg.threads, sizeof(Worker));
+  pthread_t *tids = calloc(cfg.threads, sizeof(pthread_t));
+  if (!ws || !tids) return 1;
+  for (u32 t = 0; t < cfg.threads; t++) {
+    ws[t].cfg = &cfg;
+    ws[t].id = t;
+    ws[t].dirs = build_tree(&cfg, t, &ws[t].ndirs);
+    if (!ws[t].dirs) { fprintf(stderr, "mdgen: out of memory\n"); return 1; }
+  }
+  fprintf(stderr, "mdgen: %u threads x %zu dirs x %u files under %s\n",
+          cfg.threads, ws[0].ndirs, cfg.files_per_dir, root);
+
+  pthread_barrier_init(&phase_start, NULL, cfg.threads + 1);
+  pthread_barrier_init(&phase_end, NULL, cfg.threads + 1);
+  for (u32 t = 0; t < cfg.threads; t++) pthread_create(&tids[t], NULL, worker_main, &ws[t]);
+
+  int core_defer = !mount && cfg.defer;
+  printf("phase,ops,errors,seconds,ops_per_sec\n");
+  for (int ph = 0; ph < PH_COUNT; ph++) {
+    double t0 = now_sec();
+    pthread_barrier_wait(&phase_start);
+    pthread_barrier_wait(&phase_end);
+    if (core_defer) fs_commit(); //workers defer for themselves, see worker_main
+    double secs = now_sec() - t0;
+    u64 ops = 0, errs = 0;
+    for (u32 t = 0; t < cfg.threads; t++) { ops += ws[t].ops[ph]; errs += ws[t].errors[ph]; }
+    printf("%s,%llu,%llu,%.6f,%.1f\n", phase_names[ph], (unsigned long long)ops,
+           (unsigned long long)errs, secs, secs > 0 ? ops / secs : 0.0);
+    fflush(stdout);
+  }
+
+  for (u32 t = 0; t < cfg.threads; t++) {
+    pthread_join(tids[t], NULL);
+    for (usize i = 0; i < ws[t].ndirs; i++) free(ws[t].dirs[i]);
+    free(ws[t].dirs);
+  }
+  cfg.be->rmdir(root);
+  if (!mount) unload_fs();
+  pthread_barrier_destroy(&phase_start);
+  pthread_barrier_destroy(&phase_end);
+  free(ws);
+  free(tids);
+  return 0;
+}
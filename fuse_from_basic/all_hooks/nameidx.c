@@ -0,0 +1,120 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+
+// hashed trigram index over inode names. each bucket is a bitmap with one bit per
+// inode, so removing an inode is exact even when trigrams collide in a bucket 
+#define NAMEIDX_WORDS (MAX_INODES / 64)
+
+#define BUCKETS_PER_BLOCK (NAME_INDEX_BUCKETS / NAME_INDEX_BLOCKS)
+
+static u64 buckets[NAME_INDEX_BUCKETS][NAMEIDX_WORDS];
+static u64 dirty_blocks; // bit n set when index block n changed since the last save 
+static pthread_mutex_t idx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(sizeof(buckets) == (usize)NAME_INDEX_BLOCKS * BLOCK_SIZE,
+               "name index must fill its blocks exactly");
+_Static_assert(NAME_INDEX_BLOCKS <= 64 && NAME_INDEX_BUCKETS % NAME_INDEX_BLOCKS == 0,
+               "dirty mask needs whole buckets in at most 64 blocks");
+
+#define ALL_BLOCKS (NAME_INDEX_BLOCKS == 64 ? ~0ULL : (1ULL << NAME_INDEX_BLOCKS) - 1)
+
+static u32 trigram_bucket(const char *t) {
+  u32 h = 2166136261u; //fnv-1a
+  for (int i = 0; i < 3; i++) { h ^= (u8)t[i]; h *= 16777619u; }
+  return h % NAME_INDEX_BUCKETS;
+}
+
+int nameidx_enabled(void) {
+  return sb.name_index_block != 0;
+}
+
+void nameidx_add(u32 ino) {
+  if (!nameidx_enabled() || ino >= MAX_INODES) return;
+  const char *name = inode_table[ino].name;
+  usize len = strnlen(name, MAX_FILENAME);
+  pthread_mutex_lock(&idx_lock);
+  for (usize i = 0; i + 3 <= len; i++) {
+    u32 b = trigram_bucket(name + i);
+    u64 *word = &buckets[b][ino / 64], bit = 1ULL << (ino % 64);
+    if (*word & bit) continue;
+    *word |= bit;
+    dirty_blocks |= 1ULL << (b / BUCKETS_PER_BLOCK);
+  }
+  pthread_mutex_unlock(&idx_lock);
+}
+
+//clear the inode from every bucket, does not depend on the name still being there
+void nameidx_remove(u32 ino) {
+  if (!nameidx_enabled() || ino >= MAX_INODES) return;
+  u64 bit = 1ULL << (ino % 64);
+  pthread_mutex_lock(&idx_lock);
+  for (u32 b = 0; b < NAME_INDEX_BUCKETS; b++) {
+    if (!(buckets[b][ino / 64] & bit)) continue;
+    buckets[b][ino / 64] &= ~bit;
+    dirty_blocks |= 1ULL << (b / BUCKETS_PER_BLOCK);
+  }
+  pthread_mutex_unlock(&idx_lock);
+}
+
+//inodes whose name may contain lit, a superset of the real hits.
+//returns -1 when the index cannot help (disabled or lit shorter than a trigram)
+int nameidx_candidates(const char *lit, usize len, u64 *out) {
+  if (!nameidx_enabled() || len < 3) return -1;
+  for (u32 w = 0; w < NAMEIDX_WORDS; w++) out[w] = ~0ULL;
+  pthread_mutex_lock(&idx_lock);
+  for (usize i = 0; i + 3 <= len; i++) {
+    const u64 *bits = buckets[trigram_bucket(lit + i)];
+    for (u32 w = 0; w < NAMEIDX_WORDS; w++) out[w] &= bits[w];
+  }
+  pthread_mutex_unlock(&idx_lock);
+  return 0;
+}
+
+//create the index on this image if needed and fill it from the inode table
+int nameidx_rebuild(void) {
+  if (!sb.name_index_block) {
+    u32 b = allocate_run(NAME_INDEX_BLOCKS);
+    if (!b) return -1;
+    sb.name_index_block = b;
+  }
+  pthread_mutex_lock(&idx_lock);
+  memset(buckets, 0, sizeof(buckets));
+  dirty_blocks = ALL_BLOCKS;
+  pthread_mutex_unlock(&idx_lock);
+  for (u32 ino = 0; ino < MAX_INODES; ino++) {
+    if (inode_table[ino].used) nameidx_add(ino);
+  }
+  return sync_metadata();
+}
+
+int nameidx_load(void) {
+  pthread_mutex_lock(&idx_lock);
+  memset(buckets, 0, sizeof(buckets));
+  dirty_blocks = 0;
+  pthread_mutex_unlock(&idx_lock);
+  if (!sb.name_index_block) return 0;
+  return read_blocks(sb.name_index_block, NAME_INDEX_BLOCKS, buckets) == (ssize)sizeof(buckets) ? 0 : -1;
+}
+
+//written from sync_metadata. only the blocks that changed since the last save go out,
+//adjacent dirty blocks as one run, so a create costs a few blocks and not the whole index
+int nameidx_save(void) {
+  if (!sb.name_index_block) return 0;
+  pthread_mutex_lock(&idx_lock);
+  int r = 0;
+  u32 blk = 0;
+  while (blk < NAME_INDEX_BLOCKS && (dirty_blocks >> blk)) {
+    if (!(dirty_blocks & (1ULL << blk))) { blk++; continue; }
+    u32 run = 1;
+    while (blk + run < NAME_INDEX_BLOCKS && (dirty_blocks & (1ULL << (blk + run)))) run++;
+    ssize w = write_blocks(sb.name_index_block + blk, run, buckets[blk * BUCKETS_PER_BLOCK]);
+    if (w != (ssize)run * BLOCK_SIZE) { r = -1; break; }
+    u64 done = (run == 64 ? ~0ULL : ((1ULL << run) - 1)) << blk;
+    dirty_blocks &= ~done;
+    blk += run;
+  }
+  pthread_mutex_unlock(&idx_lock);
+  return r;
+}
@@ -0,0 +1,78 @@
+#include"virt_disk.h"
+#include<string.h>
+#include<stdlib.h>
+#include<pthread.h>
+
+// absolute paths of directories, built on demand. an entry is only valid while its
+// epoch matches path_epoch, which moves on every rename or removal of a directory 
+typedef struct DirPath {
+  char *path;
+  u32 len;
+  u32 cap;
+  u32 epoch;
+} DirPath;
+
+static DirPath dir_paths[MAX_INODES];
+static u32 path_epoch = 1;
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void path_cache_invalidate(void) {
+  pthread_mutex_lock(&path_lock);
+  path_epoch++;
+  pthread_mutex_unlock(&path_lock);
+}
+
+static void cache_dir(u32 dir, const char *path, usize len) {
+  DirPath *d = &dir_paths[dir];
+  if (d->cap < len + 1) {
+    char *p = realloc(d->path, len + 1);
+    if (!p) return; //just stays uncached
+    d->path = p;
+    d->cap = len + 1;
+  }
+  memcpy(d->path, path, len);
+  d->path[len] = '\0';
+  d->len = len;
+  d->epoch = path_epoch;
+}
+
+//write the absolute path of ino into buf. climbs only until the first directory with a
+//cached path, so the cost is the length of the result. -1 for orphans or if cap is too small
+ssize fs_path_of(u32 ino, char *buf, usize cap) {
+  if (cap < 2 || ino >= MAX_INODES) return -1;
+  if (ino == 0) { buf[0] = '/'; buf[1] = '\0'; return 1; }
+
+  u32 chain[MAX_INODES];
+  u32 n = 0, cur = ino;
+  usize len = 0;
+  pthread_mutex_lock(&path_lock);
+  while (cur != 0) {
+    if (cur >= MAX_INODES || !inode_table[cur].used || n >= MAX_INODES) goto invalid; //orphan or cycle
+    DirPath *d = &dir_paths[cur];
+    if (d->epoch == path_epoch && d->path) {
+      if (d->len + 1 > cap) goto invalid;
+      memcpy(buf, d->path, d->len);
+      len = d->len;
+      break;
+    }
+    chain[n++] = cur;
+    cur = inode_table[cur].parent;
+  }
+  //root has no name, everything below it starts with '/'
+  while (n > 0) {
+    u32 id = chain[--n];
+    usize nl = strnlen(inode_table[id].name, MAX_FILENAME);
+    if (len + 1 + nl + 1 > cap) goto invalid;
+    buf[len++] = '/';
+    memcpy(buf + len, inode_table[id].name, nl);
+    len += nl;
+    if (inode_table[id].is_dir) cache_dir(id, buf, len);
+  }
+  pthread_mutex_unlock(&path_lock);
+  buf[len] = '\0';
+  return (ssize)len;
+
+invalid:
+  pthread_mutex_unlock(&path_lock);
+  return -1;
+}
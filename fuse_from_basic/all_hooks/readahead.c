@@ -0,0 +1,112 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+
+#define RA_QUEUE_LEN 64
+
+typedef struct RaJob {
+  u32 count;
+  u32 blocks[RA_MAX_WINDOW];
+} RaJob;
+
+static RaJob queue[RA_QUEUE_LEN];
+static u32 q_head, q_tail;              // ring buffer, head == tail means empty 
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ra_once = PTHREAD_ONCE_INIT;
+static int ra_started;
+
+static int cmp_u32(const void *a, const void *b) {
+  u32 x = *(const u32*)a, y = *(const u32*)b;
+  return (x > y) - (x < y);
+}
+
+//read the job in on-image order, one pread per run of adjacent blocks
+static void ra_process(RaJob *job) {
+  u8 runbuf[RA_MAX_WINDOW * BLOCK_SIZE];
+  u32 gens[RA_MAX_WINDOW];
+  qsort(job->blocks, job->count, sizeof(u32), cmp_u32);
+  u32 i = 0;
+  while (i < job->count) {
+    u32 start = job->blocks[i];
+    u32 n = 1;
+    while (i + n < job->count && job->blocks[i + n] == start + n) n++;
+    for (u32 k = 0; k < n; k++) gens[k] = bcache_write_gen(start + k);
+    if (read_blocks(start, n, runbuf) == (ssize)n * BLOCK_SIZE) {
+      for (u32 k = 0; k < n; k++) bcache_fill(start + k, runbuf + (usize)k * BLOCK_SIZE, gens[k]);
+    }
+    i += n;
+  }
+}
+
+static void* ra_worker(void *arg) {
+  (void) arg;
+  for (;;) {
+    pthread_mutex_lock(&ra_lock);
+    while (q_head == q_tail) pthread_cond_wait(&ra_cond, &ra_lock);
+    RaJob job = queue[q_head];
+    q_head = (q_head + 1) % RA_QUEUE_LEN;
+    pthread_mutex_unlock(&ra_lock);
+    ra_process(&job);
+  }
+  return NULL;
+}
+
+static void ra_start(void) {
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, ra_worker, NULL) != 0) {
+    fprintf(stderr, "readahead: worker not started, prefetch disabled\n");
+    return;
+  }
+  pthread_detach(tid);
+  ra_started = 1;
+}
+
+//queue blocks for prefetch, dropped silently when the worker is behind
+void ra_submit(const u32 *blocks, u32 count) {
+  if (count == 0) return;
+  if (count > RA_MAX_WINDOW) count = RA_MAX_WINDOW;
+  pthread_once(&ra_once, ra_start);
+  if (!ra_started) return;
+  pthread_mutex_lock(&ra_lock);
+  u32 next = (q_tail + 1) % RA_QUEUE_LEN;
+  if (next != q_head) {
+    queue[q_tail].count = count;
+    memcpy(queue[q_tail].blocks, blocks, count * sizeof(u32));
+    q_tail = next;
+    pthread_cond_signal(&ra_cond);
+  }
+  pthread_mutex_unlock(&ra_lock);
+}
+
+//called after every handle read, grows the window on sequential streams
+//and halves it on random access
+void ra_on_read(FileHandle *fh) {
+  if (fh->seq_count == 0) {
+    fh->ra_window /= 2;
+    fh->ra_end = 0;
+    return;
+  }
+  if (fh->ra_window == 0) fh->ra_window = RA_MIN_WINDOW;
+  else if (fh->ra_window * 2 <= RA_MAX_WINDOW) fh->ra_window *= 2;
+  else fh->ra_window = RA_MAX_WINDOW;
+
+  Inode *in = &inode_table[fh->ino];
+  u32 nblocks = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (nblocks > DIRECT_PTRS) nblocks = DIRECT_PTRS;
+  u32 next_bi = fh->next_off / BLOCK_SIZE;
+  u32 start = next_bi > fh->ra_end ? next_bi : fh->ra_end;
+  u32 end = next_bi + fh->ra_window;
+  if (end > nblocks) end = nblocks;
+  if (start >= end) return;
+
+  u32 blocks[RA_MAX_WINDOW];
+  u32 n = 0;
+  for (u32 i = start; i < end; i++) {
+    if (fh->map[i] && !bcache_contains(fh->map[i])) blocks[n++] = fh->map[i];
+  }
+  fh->ra_end = end;
+  ra_submit(blocks, n);
+}
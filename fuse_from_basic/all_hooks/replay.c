@@ -0,0 +1,240 @@
+#define _GNU_SOURCE //fallocate
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<dirent.h>
+#include<sys/stat.h>
+#include<sys/statvfs.h>
+
+// replay an operation trace recorded with fuse_mount --trace=<file>, either through the
+// core api on ./virtual_disk.img or as plain syscalls under a mount (-m). by default
+// the trace runs as fast as possible, -r keeps the recorded spacing between requests.
+// one csv row per op type: op,count,errors,diverged,seconds
+// diverged counts requests whose success or failure differs from the recording
+
+static const char *op_names[TR_OP_END] = {
+  "none", "getattr", "readdir", "open", "read", "write", "flush", "release", "mkdir",
+  "create", "unlink", "rmdir", "rename", "utimens", "statfs", "clone", "truncate",
+  "ftruncate", "fallocate", "block_read", "block_write",
+};
+
+typedef struct OpTotals {
+  u64 count;
+  u64 errors;
+  u64 diverged;
+  u64 ns;
+} OpTotals;
+
+static u8 *io_buf;
+static usize io_cap;
+
+static u8* buffer_of(u64 len) {
+  if (len > io_cap) {
+    u8 *n = realloc(io_buf, len);
+    if (!n) return NULL;
+    memset(n, 0x5a, len);
+    io_buf = n;
+    io_cap = len;
+  }
+  return io_buf;
+}
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+// ---- core api ----
+
+static int core_inode(const char *path, u32 *ino) {
+  if (strcmp(path, "/") == 0) { *ino = 0; return 0; }
+  u32 parent, target;
+  char name[MAX_FILENAME];
+  if (resolve_path(path + (path[0] == '/'), 1, &parent, name, &target) < 0 || !target) return -1;
+  *ino = target;
+  return 0;
+}
+
+static int core_file_io(const TraceRec *r, const char *path, int is_write) {
+  u32 ino;
+  if (core_inode(path, &ino) < 0 || inode_table[ino].is_dir) return -1;
+  u8 *buf = buffer_of(r->len);
+  if (!buf && r->len) return -1;
+  FileHandle *fh = fh_open(ino);
+  if (!fh) return -1;
+  ssize n = is_write ? fh_write(fh, buf, r->len, (off_t)r->off) : fh_read(fh, buf, r->len, (off_t)r->off);
+  fh_close(fh);
+  return n < 0 ? -1 : 0;
+}
+
+static int replay_core(const TraceRec *r, const char *path, const char *path2) {
+  u32 ino;
+  switch (r->op) {
+    case TR_GETATTR: case TR_OPEN: case TR_RELEASE: case TR_UTIMENS:
+      return core_inode(path, &ino); //all the core does for these is the lookup
+    case TR_READDIR: {
+      if (core_inode(path, &ino) < 0 || !inode_table[ino].is_dir) return -1;
+      usize cnt;
+      free(read_dir_entries(&inode_table[ino], &cnt));
+      return 0;
+    }
+    case TR_READ: return core_file_io(r, path, 0);
+    case TR_WRITE: return core_file_io(r, path, 1);
+    case TR_FLUSH: return sync_metadata();
+    case TR_MKDIR: return fs_create_dir(path) > 0 ? 0 : -1;
+    case TR_CREATE: return fs_create_file(path) > 0 ? 0 : -1;
+    case TR_UNLINK: case TR_RMDIR: return fs_unlink(path);
+    case TR_RENAME: return fs_rename(path, path2);
+    case TR_STATFS: { u32 fb, fi; fs_counters(&fb, &fi); return 0; }
+    case TR_CLONE: return fs_clone_file(path, path2) > 0 ? 0 : -1;
+    case TR_TRUNCATE: case TR_FTRUNCATE:
+      if (core_inode(path, &ino) < 0) return -1;
+      return fs_truncate(ino, r->len);
+    case TR_FALLOCATE:
+      //the recorded mode is the linux one, KEEP_SIZE and PUNCH_HOLE have the same bits
+      if (core_inode(path, &ino) < 0) return -1;
+      return fs_fallocate(ino, r->mode, r->off, r->len);
+  }
+  return -1;
+}
+
+// ---- plain syscalls under a mount ----
+
+static const char *mount_dir;
+
+static int posix_file_io(const TraceRec *r, const char *p, int is_write) {
+  int fd = open(p, is_write ? O_WRONLY : O_RDONLY);
+  if (fd < 0) return -1;
+  u8 *buf = buffer_of(r->len);
+  ssize n = -1;
+  if (buf || !r->len) n = is_write ? pwrite(fd, buf, r->len, (off_t)r->off) : pread(fd, buf, r->len, (off_t)r->off);
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+static int replay_posix(const TraceRec *r, const char *path, const char *path2) {
+  char p[TRACE_MAX_PATH * 2], p2[TRACE_MAX_PATH * 2];
+  snprintf(p, sizeof(p), "%s%s", mount_dir, path);
+  snprintf(p2, sizeof(p2), "%s%s", mount_dir, path2);
+  struct stat st;
+  int fd, ret;
+  switch (r->op) {
+    case TR_GETATTR: return stat(p, &st);
+    case TR_READDIR: {
+      DIR *d = opendir(p);
+      if (!d) return -1;
+      while (readdir(d)) {}
+      closedir(d);
+      return 0;
+    }
+    case TR_OPEN:
+      fd = open(p, O_RDONLY);
+      if (fd < 0) return -1;
+      close(fd);
+      return 0;
+    case TR_FLUSH: case TR_RELEASE: return 0; //part of the open/close around each replayed i/o
+    case TR_READ: return posix_file_io(r, p, 0);
+    case TR_WRITE: return posix_file_io(r, p, 1);
+    case TR_MKDIR: return mkdir(p, 0755);
+    case TR_CREATE:
+      fd = open(p, O_WRONLY | O_CREAT, 0644);
+      if (fd < 0) return -1;
+      close(fd);
+      return 0;
+    case TR_UNLINK: return unlink(p);
+    case TR_RMDIR: return rmdir(p);
+    case TR_RENAME: return rename(p, p2);
+    case TR_UTIMENS: return utimensat(AT_FDCWD, p, NULL, 0);
+    case TR_STATFS: { struct statvfs sv; return statvfs(p, &sv); }
+    case TR_CLONE: {
+      CloneReq req;
+      snprintf(req.dst, sizeof(req.dst), "%s", path2); //path inside the image, as recorded
+      fd = open(p, O_RDONLY);
+      if (fd < 0) return -1;
+      ret = ioctl(fd, VDISK_IOC_CLONE, &req);
+      close(fd);
+      return ret;
+    }
+    case TR_TRUNCATE: case TR_FTRUNCATE: return truncate(p, (off_t)r->len);
+    case TR_FALLOCATE:
+      fd = open(p, O_WRONLY);
+      if (fd < 0) return -1;
+      ret = fallocate(fd, r->mode, (off_t)r->off, (off_t)r->len);
+      close(fd);
+      return ret;
+  }
+  return -1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-m mountdir] [-r] <trace>\n"
+                  "  without -m the core api runs on ./%s, -r replays at the recorded pace\n",
+          prog, DISK_PATH);
+}
+
+int main(int argc, char **argv) {
+  int realtime = 0;
+  const char *trace = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0) realtime = 1;
+    else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) mount_dir = argv[++i];
+    else if (!trace && argv[i][0] != '-') trace = argv[i];
+    else { usage(argv[0]); return 1; }
+  }
+  if (!trace) { usage(argv[0]); return 1; }
+
+  FILE *f = trace_read_open(trace);
+  if (!f) { fprintf(stderr, "replay: '%s' is not a trace file\n", trace); return 1; }
+  if (!mount_dir) {
+    if (access(DISK_PATH, F_OK) != 0 && format_fs() < 0) { fprintf(stderr, "replay: format failed\n"); return 1; }
+    if (load_fs() < 0) { fprintf(stderr, "replay: cannot load %s\n", DISK_PATH); return 1; }
+  }
+
+  static char path[TRACE_MAX_PATH + 1], path2[TRACE_MAX_PATH + 1];
+  OpTotals totals[TR_OP_END];
+  memset(totals, 0, sizeof(totals));
+  TraceRec r;
+  int rc;
+  u64 start = now_ns(), skipped = 0;
+  while ((rc = trace_next(f, &r, path, path2)) == 1) {
+    //block records are for cachesim, replaying the requests recreates them
+    if (r.op == 0 || r.op >= TR_BLOCK_READ || strcmp(path, STATS_FILE) == 0) { skipped++; continue; }
+    if (realtime) {
+      u64 due = start + r.ts_ns, now = now_ns();
+      if (due > now) {
+        struct timespec ts = { (time_t)((due - now) / 1000000000ull), (long)((due - now) % 1000000000ull) };
+        nanosleep(&ts, NULL);
+      }
+    }
+    u64 t0 = now_ns();
+    int res = mount_dir ? replay_posix(&r, path, path2) : replay_core(&r, path, path2);
+    OpTotals *t = &totals[r.op];
+    t->ns += now_ns() - t0;
+    t->count++;
+    if (res < 0) t->errors++;
+    if ((res < 0) != (r.result < 0)) t->diverged++;
+  }
+  double secs = (now_ns() - start) / 1e9;
+  fclose(f);
+  if (rc < 0) fprintf(stderr, "replay: trace is truncated or corrupt, stopped early\n");
+  if (!mount_dir) unload_fs();
+
+  u64 ops = 0;
+  printf("op,count,errors,diverged,seconds\n");
+  for (int op = 1; op < TR_OP_END; op++) {
+    if (!totals[op].count) continue;
+    ops += totals[op].count;
+    printf("%s,%llu,%llu,%llu,%.6f\n", op_names[op], (unsigned long long)totals[op].count,
+           (unsigned long long)totals[op].errors, (unsigned long long)totals[op].diverged,
+           totals[op].ns / 1e9);
+  }
+  fprintf(stderr, "replay: %llu ops in %.3fs (%.1f ops/sec), %llu skipped\n", (unsigned long long)ops,
+          secs, secs > 0 ? ops / secs : 0.0, (unsigned long long)skipped);
+  free(io_buf);
+  return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<pthread.h>
+
+// slow operation log. requests over the threshold go into a fixed ring under a lock
+// (only slow requests ever take it), a background thread drains the ring to a host
+// file so the request itself never waits on that write
+#define SLOWLOG_RING 1024
+#define SLOWLOG_PATH 128 // longer paths are cut, the log is for spotting stalls 
+
+typedef struct SlowEntry {
+  struct timespec when;
+  const char *op;
+  char path[SLOWLOG_PATH];
+  long ino;      // -1 when the request had no open file 
+  u64 ns;
+  u64 ios;       // preads + pwrites the request issued 
+  u64 fsyncs;
+} SlowEntry;
+
+static SlowEntry ring[SLOWLOG_RING];
+static u32 ring_head, ring_tail; // head is the next slot to fill 
+static u64 dropped;
+static u64 threshold_ns;         // 0 = log disabled 
+static int log_fd = -1;
+static int stopping;
+static pthread_t flusher;
+static int flusher_running;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+u64 slowlog_threshold(void) {
+  return threshold_ns;
+}
+
+void slowlog_record(const char *op, const char *path, long ino, u64 ns, u64 ios, u64 fsyncs) {
+  if (!threshold_ns || ns < threshold_ns) return;
+  pthread_mutex_lock(&ring_lock);
+  if (ring_head - ring_tail >= SLOWLOG_RING) { //flusher is behind, keep the older entries
+    dropped++;
+    pthread_mutex_unlock(&ring_lock);
+    return;
+  }
+  SlowEntry *e = &ring[ring_head % SLOWLOG_RING];
+  clock_gettime(CLOCK_REALTIME, &e->when);
+  e->op = op;
+  snprintf(e->path, sizeof(e->path), "%s", path ? path : "-");
+  e->ino = ino;
+  e->ns = ns;
+  e->ios = ios;
+  e->fsyncs = fsyncs;
+  ring_head++;
+  pthread_cond_signal(&ring_cond);
+  pthread_mutex_unlock(&ring_lock);
+}
+
+static usize format_entry(const SlowEntry *e, char *buf, usize cap) {
+  int n = snprintf(buf, cap, "%lld.%03ld op=%s path=%s ino=%ld dur_us=%llu ios=%llu fsyncs=%llu\n",
+                   (long long)e->when.tv_sec, e->when.tv_nsec / 1000000, e->op, e->path, e->ino,
+                   (unsigned long long)(e->ns / 1000), (unsigned long long)e->ios,
+                   (unsigned long long)e->fsyncs);
+  return n > 0 && (usize)n < cap ? (usize)n : 0;
+}
+
+//copy everything queued out of the ring and write it with the lock dropped
+static void drain(void) {
+  static SlowEntry batch[SLOWLOG_RING];
+  char line[SLOWLOG_PATH + 160];
+  pthread_mutex_lock(&ring_lock);
+  u32 n = 0;
+  while (ring_tail != ring_head) batch[n++] = ring[ring_tail++ % SLOWLOG_RING];
+  u64 lost = dropped;
+  dropped = 0;
+  pthread_mutex_unlock(&ring_lock);
+
+  for (u32 i = 0; i < n; i++) {
+    usize len = format_entry(&batch[i], line, sizeof(line));
+    if (len) host_write_all(log_fd, (const u8 *)line, len);
+  }
+  if (lost) {
+    int len = snprintf(line, sizeof(line), "dropped=%llu entries, log ring was full\n", (unsigned long long)lost);
+    if (len > 0) host_write_all(log_fd, (const u8 *)line, (usize)len);
+  }
+}
+
+static void* flusher_main(void *arg) {
+  (void) arg;
+  for (;;) {
+    pthread_mutex_lock(&ring_lock);
+    while (ring_tail == ring_head && !dropped && !stopping) pthread_cond_wait(&ring_cond, &ring_lock);
+    int stop = stopping;
+    pthread_mutex_unlock(&ring_lock);
+    drain();
+    if (stop) return NULL;
+  }
+}
+
+//start logging requests slower than threshold_ms to host_path (appended to). the file
+//is opened here, before fuse may daemonize, but the flusher only runs after
+//slowlog_start since threads do not survive the fork. until then entries queue up
+int slowlog_open(const char *host_path, u64 threshold_ms) {
+  if (log_fd >= 0 || threshold_ms == 0) return -1;
+  log_fd = open(host_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (log_fd < 0) return -1;
+  threshold_ns = threshold_ms * 1000000ull;
+  return 0;
+}
+
+//start the flusher thread in the process that serves requests
+int slowlog_start(void) {
+  if (log_fd < 0 || flusher_running) return 0;
+  if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) return -1;
+  flusher_running = 1;
+  return 0;
+}
+
+//stop taking entries, write out what is queued and close the file
+void slowlog_close(void) {
+  if (log_fd < 0) return;
+  threshold_ns = 0;
+  if (flusher_running) {
+    pthread_mutex_lock(&ring_lock);
+    stopping = 1;
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = 0;
+  } else {
+    drain();
+  }
+  close(log_fd);
+  log_fd = -1;
+}
@@ -0,0 +1,110 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+
+// per operation latency histograms. buckets are log-linear like hdr histograms: exact
+// below 16ns, then 16 sub buckets per power of two, so every bucket is within ~6% of
+// the values it holds. updates are relaxed atomics, readers get a consistent enough view
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1u << STATS_SUB_BITS)
+#define STATS_MAX_EXP 40 // ~18 minutes, anything slower lands in the last bucket 
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB)
+
+typedef struct OpHist {
+  u64 count;
+  u64 total_ns;
+  u64 max_ns;
+  u64 buckets[STATS_BUCKETS];
+} OpHist;
+
+static OpHist hists[ST_COUNT];
+
+static const char *op_names[ST_COUNT] = {
+  "resolve_path", "sync_metadata", "read_block", "fsync",
+  "fuse_getattr", "fuse_readdir", "fuse_open", "fuse_read", "fuse_write", "fuse_flush",
+  "fuse_release", "fuse_mkdir", "fuse_create", "fuse_unlink", "fuse_rmdir", "fuse_rename",
+  "fuse_utimens", "fuse_statfs", "fuse_ioctl", "fuse_truncate", "fuse_ftruncate", "fuse_fallocate",
+};
+
+const char* stats_op_name(int op) {
+  return op >= 0 && op < ST_COUNT ? op_names[op] : "unknown";
+}
+
+u64 stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static u32 bucket_of(u64 ns) {
+  if (ns < STATS_SUB) return (u32)ns;
+  u32 e = 63 - (u32)__builtin_clzll(ns);
+  if (e > STATS_MAX_EXP) return STATS_BUCKETS - 1;
+  u32 sub = (u32)(ns >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1);
+  u32 b = (e - STATS_SUB_BITS + 1) * STATS_SUB + sub;
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+//middle of the value range covered by bucket b
+static u64 bucket_value(u32 b) {
+  if (b < STATS_SUB) return b;
+  u32 e = b / STATS_SUB + STATS_SUB_BITS - 1;
+  u64 lo = (u64)(STATS_SUB + b % STATS_SUB) << (e - STATS_SUB_BITS);
+  return lo + ((1ull << (e - STATS_SUB_BITS)) >> 1);
+}
+
+void stats_record(int op, u64 start_ns) {
+  if (op < 0 || op >= ST_COUNT) return;
+  u64 ns = stats_now() - start_ns;
+  OpHist *h = &hists[op];
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  u64 m = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+  while (ns > m && !__atomic_compare_exchange_n(&h->max_ns, &m, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//value below which permille/1000 of the samples fall, never above the recorded max
+static u64 percentile(const OpHist *h, u64 count, u32 permille) {
+  if (!count) return 0;
+  u64 want = (count * permille + 999) / 1000, seen = 0;
+  u64 max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+  for (u32 b = 0; b < STATS_BUCKETS; b++) {
+    seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (seen >= want) return bucket_value(b) < max ? bucket_value(b) : max;
+  }
+  return max;
+}
+
+//text snapshot, one line per operation. returns the full length even if cap cut it short
+usize stats_format(char *buf, usize cap) {
+  usize len = 0;
+  int n = snprintf(buf, cap, "# op count total_ns p50_ns p90_ns p99_ns p999_ns max_ns\n");
+  if (n > 0) len += (usize)n;
+  for (int op = 0; op < ST_COUNT; op++) {
+    const OpHist *h = &hists[op];
+    u64 count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    n = snprintf(len < cap ? buf + len : NULL, len < cap ? cap - len : 0,
+                 "%s %llu %llu %llu %llu %llu %llu %llu\n", op_names[op],
+                 (unsigned long long)count,
+                 (unsigned long long)__atomic_load_n(&h->total_ns, __ATOMIC_RELAXED),
+                 (unsigned long long)percentile(h, count, 500),
+                 (unsigned long long)percentile(h, count, 900),
+                 (unsigned long long)percentile(h, count, 990),
+                 (unsigned long long)percentile(h, count, 999),
+                 (unsigned long long)__atomic_load_n(&h->max_ns, __ATOMIC_RELAXED));
+    if (n > 0) len += (usize)n;
+  }
+  return len;
+}
+
+void stats_reset(void) {
+  for (int op = 0; op < ST_COUNT; op++) {
+    OpHist *h = &hists[op];
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->max_ns, 0, __ATOMIC_RELAXED);
+    for (u32 b = 0; b < STATS_BUCKETS; b++) __atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+  }
+}
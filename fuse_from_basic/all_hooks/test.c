@@ -0,0 +1,643 @@
+#include "virt_disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+//main.c has no header, pull in its batch runner the way the top level test.c pulls in fsops.c
+#define main virt_dsk_main
+#include "main.c"
+#undef main
+
+// scripted behaviour checks against a freshly formatted scratch image, in the spirit of
+// the top level test.c. every check prints ok or FAIL, the exit status is the number of
+// failures so make check can gate on it
+
+static int failures;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) failures++;
+}
+
+static int fresh_image(void) {
+    //format_fs prints its layout, keep the report readable
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved >= 0 && devnull >= 0) dup2(devnull, STDOUT_FILENO);
+    int r = format_fs();
+    fflush(stdout);
+    if (saved >= 0) { dup2(saved, STDOUT_FILENO); close(saved); }
+    if (devnull >= 0) close(devnull);
+    if (r < 0 || load_fs() < 0) {
+        printf("FAIL: cannot format scratch image\n");
+        failures++;
+        return -1;
+    }
+    return 0;
+}
+
+static u32 free_blocks(void) {
+    u32 fb;
+    fs_counters(&fb, NULL);
+    return fb;
+}
+
+static u32 inode_of(const char *name) {
+    return dir_lookup(&inode_table[0], name);
+}
+
+static void fill(u8 *buf, usize len, u8 seed) {
+    for (usize i = 0; i < len; i++) buf[i] = (u8)(seed + i * 7);
+}
+
+//one column of an io_format line, col 0 is preads
+static u64 io_counter(const char *cat, int col) {
+    char buf[2048], key[32];
+    usize n = io_format(buf, sizeof(buf));
+    if (n >= sizeof(buf)) return 0;
+    snprintf(key, sizeof(key), "io_%s ", cat);
+    const char *p = strstr(buf, key);
+    if (!p) return 0;
+    p += strlen(key);
+    char *end;
+    u64 v = strtoull(p, &end, 10);
+    for (int i = 0; i < col; i++) v = strtoull(end, &end, 10);
+    return v;
+}
+
+// ---- clone and copy on write ----
+
+static void test_clone(void) {
+    if (fresh_image() < 0) return;
+    u8 data[3000], got[3000];
+    fill(data, sizeof(data), 1);
+    fs_create_file("/keep"); //keeps the root entry block mapped so counts only see file data
+    fs_create_file("/a");
+    fs_write_file("/a", data, sizeof(data));
+    //the first clone in an image also claims the on-disk refcount area
+    u32 before = free_blocks() - (sb.refcount_block ? 0 : REFCOUNT_BLOCKS);
+
+    check(fs_clone_file("/a", "/b") > 0, "clone /a to /b");
+    u32 a = inode_of("a"), b = inode_of("b");
+    check(free_blocks() == before, "clone allocates no data blocks");
+    check(memcmp(inode_table[a].direct, inode_table[b].direct, sizeof(inode_table[a].direct)) == 0,
+          "clone maps the same blocks");
+    check(block_shared(inode_table[a].direct[0]) && block_shared(inode_table[a].direct[2]),
+          "cloned blocks are shared");
+    check(fs_read_file("/b", got, sizeof(got)) == (ssize)sizeof(got) && memcmp(got, data, sizeof(got)) == 0,
+          "clone reads back the source data");
+
+    //a partial write into block 0 of the clone must copy it first
+    FileHandle *fh = fh_open(b);
+    const u8 patch[10] = "0123456789";
+    check(fh && fh_write(fh, patch, sizeof(patch), 100) == (ssize)sizeof(patch), "write into the clone");
+    fh_close(fh);
+    check(inode_table[a].direct[0] != inode_table[b].direct[0], "written block is copied");
+    check(inode_table[a].direct[1] == inode_table[b].direct[1], "untouched blocks stay shared");
+    check(!block_shared(inode_table[a].direct[0]), "source block is no longer shared");
+    check(free_blocks() == before - 1, "copy on write takes one block");
+    check(fs_read_file("/a", got, sizeof(got)) == (ssize)sizeof(got) && memcmp(got, data, sizeof(got)) == 0,
+          "source is unchanged by the clone write");
+    memcpy(data + 100, patch, sizeof(patch));
+    check(fs_read_file("/b", got, sizeof(got)) == (ssize)sizeof(got) && memcmp(got, data, sizeof(got)) == 0,
+          "clone sees its own write over the old bytes");
+
+    //dropping one owner only frees the blocks nobody else maps
+    fs_unlink("/a");
+    check(free_blocks() == before, "unlinking the source frees only its private block");
+    check(!block_shared(inode_table[b].direct[1]), "clone is the last owner of the rest");
+    check(fs_read_file("/b", got, sizeof(got)) == (ssize)sizeof(got) && memcmp(got, data, sizeof(got)) == 0,
+          "clone survives the source");
+    fs_unlink("/b");
+    check(free_blocks() == before + 3, "unlinking the clone frees everything");
+}
+
+// ---- handles on freed inodes ----
+
+static void test_stale_handle(void) {
+    if (fresh_image() < 0) return;
+    u8 data[2000], got[2000];
+    fill(data, sizeof(data), 9);
+    fs_create_file("/keep");
+    fs_create_file("/h");
+    fs_write_file("/h", data, sizeof(data));
+    u32 h = inode_of("h");
+    FileHandle *fh = fh_open(h);
+    check(fh && fh_read(fh, got, sizeof(got), 0) == (ssize)sizeof(got), "read through an open handle");
+
+    //what hard_remove does: the inode goes away while the handle is still open
+    fs_unlink("/h");
+    u32 before = free_blocks();
+    check(fh && fh_write(fh, data, sizeof(data), 0) == -ESTALE, "write on a freed inode is stale");
+    check(fh && fh_read(fh, got, sizeof(got), 0) == -ESTALE, "read on a freed inode is stale");
+    check(free_blocks() == before && inode_table[h].direct[0] == 0, "stale write maps no blocks");
+
+    //the slot comes back as another file, the old handle must not reach it
+    check(fs_create_file("/other") == (int)h, "freed slot is reused");
+    check(fh && fh_write(fh, data, 10, 0) == -ESTALE, "old handle cannot write the new file");
+    check(inode_table[h].size == 0 && inode_table[h].direct[0] == 0, "new file is untouched");
+    fh_close(fh);
+    fh = fh_open(h);
+    check(fh && fh_write(fh, data, 10, 0) == 10, "a fresh handle on the new file works");
+    fh_close(fh);
+}
+
+// ---- truncate, punch and fallocate ----
+
+static int all_bytes(const u8 *buf, usize from, usize to, u8 v) {
+    for (usize i = from; i < to; i++) if (buf[i] != v) return 0;
+    return 1;
+}
+
+static void test_truncate(void) {
+    if (fresh_image() < 0) return;
+    u8 data[6000], got[6000];
+    memset(data, 'x', sizeof(data));
+    fs_create_file("/keep");
+    fs_create_file("/t");
+    fs_write_file("/t", data, 5000);
+    u32 t = inode_of("t");
+    u32 before = free_blocks();
+
+    check(fs_truncate(t, 1500) == 0 && inode_table[t].size == 1500, "shrink to 1500 bytes");
+    check(free_blocks() == before + 3, "shrink frees the three blocks past the end");
+    check(inode_table[t].direct[2] == 0, "freed pointers are cleared");
+    check(fs_truncate(t, 4000) == 0 && inode_table[t].size == 4000, "grow back to 4000 bytes");
+    check(free_blocks() == before + 3, "growing allocates nothing");
+    check(fs_read_file("/t", got, 4000) == 4000 && all_bytes(got, 0, 1500, 'x') && all_bytes(got, 1500, 4000, 0),
+          "old tail reads back as zeros after growing");
+
+    //shrinking a clone zeroes its tail in a private copy, never in the shared block
+    fs_write_file("/t", data, 3000);
+    fs_clone_file("/t", "/s");
+    u32 s = inode_of("s");
+    check(fs_truncate(s, 500) == 0, "shrink a clone into a shared block");
+    check(inode_table[s].direct[0] != inode_table[t].direct[0], "tail block is copied before zeroing");
+    check(fs_read_file("/t", got, 3000) == 3000 && all_bytes(got, 0, 3000, 'x'), "source keeps its bytes");
+
+    memset(data, 'y', sizeof(data));
+    fs_write_file("/t", data, 6000);
+    before = free_blocks();
+    int keep_punch = FS_FALLOC_KEEP_SIZE | FS_FALLOC_PUNCH_HOLE;
+    check(fs_fallocate(t, FS_FALLOC_PUNCH_HOLE, 1024, 2048) < 0, "punch without keep size is refused");
+    check(fs_fallocate(t, keep_punch, 1024, 2048) == 0, "punch two whole blocks");
+    check(inode_table[t].direct[1] == 0 && inode_table[t].direct[2] == 0, "punched blocks are unmapped");
+    check(free_blocks() == before + 2, "punched blocks go back to the pool");
+    check(inode_table[t].size == 6000, "punch keeps the size");
+    check(fs_fallocate(t, keep_punch, 100, 100) == 0, "punch inside one block");
+    check(inode_table[t].direct[0] != 0 && free_blocks() == before + 2, "partial punch keeps the block");
+    check(fs_read_file("/t", got, 6000) == 6000 && all_bytes(got, 0, 100, 'y') && all_bytes(got, 100, 200, 0) &&
+          all_bytes(got, 200, 1024, 'y') && all_bytes(got, 1024, 3072, 0) && all_bytes(got, 3072, 6000, 'y'),
+          "punched ranges read as zeros, the rest is intact");
+
+    fs_create_file("/f");
+    u32 f = inode_of("f");
+    before = free_blocks();
+    check(fs_fallocate(f, FS_FALLOC_KEEP_SIZE, 0, 4096) == 0, "reserve four blocks with keep size");
+    check(inode_table[f].size == 0 && free_blocks() == before - 4, "keep size maps blocks, size stays 0");
+    check(fs_fallocate(f, 0, 0, 5000) == 0 && inode_table[f].size == 5000, "plain fallocate extends the size");
+    check(free_blocks() == before - 5, "only the missing block is added");
+    check(fs_read_file("/f", got, 5000) == 5000 && all_bytes(got, 0, 5000, 0), "allocated range reads as zeros");
+    check(fs_fallocate(f, 0, 0, (u64)DIRECT_PTRS * BLOCK_SIZE + 1) < 0, "fallocate past the last pointer fails");
+
+    //blocks reserved past eof with keep size can be punched again
+    before = free_blocks();
+    check(fs_fallocate(f, FS_FALLOC_KEEP_SIZE, 8192, 3 * BLOCK_SIZE) == 0 && free_blocks() == before - 3,
+          "reserve three blocks past eof");
+    check(fs_fallocate(f, keep_punch, 8192, 3 * BLOCK_SIZE) == 0, "punch the blocks past eof");
+    check(inode_table[f].direct[8] == 0 && inode_table[f].direct[10] == 0 && free_blocks() == before,
+          "punch past eof frees the reserved blocks");
+    check(inode_table[f].size == 5000, "punch past eof keeps the size");
+}
+
+// ---- clean flag and counter recount ----
+
+static u32 raw_sb_field(usize off) {
+    u32 v = 0;
+    int fd = open(DISK_PATH, O_RDONLY);
+    if (fd >= 0) { if (pread(fd, &v, sizeof(v), (off_t)off) != sizeof(v)) v = 0; close(fd); }
+    return v;
+}
+
+static void set_raw_sb_field(usize off, u32 v) {
+    int fd = open(DISK_PATH, O_WRONLY);
+    if (fd >= 0) { if (pwrite(fd, &v, sizeof(v), (off_t)off) != sizeof(v)) failures++; close(fd); }
+}
+
+static void test_recount(void) {
+    if (fresh_image() < 0) return;
+    u8 data[4500];
+    memset(data, 'r', sizeof(data));
+    fs_create_dir("/d");
+    fs_create_file("/d/a");
+    fs_write_file("/d/a", data, sizeof(data));
+    fs_clone_file("/d/a", "/d/b");
+    fs_create_file("/gone");
+    fs_unlink("/gone");
+    u32 fb, fi;
+    fs_counters(&fb, &fi);
+    check(raw_sb_field(offsetof(SuperBlock, state)) == SB_STATE_DIRTY, "image is dirty while mounted");
+    check(unload_fs() == 0, "unload");
+    check(raw_sb_field(offsetof(SuperBlock, state)) == SB_STATE_CLEAN, "unload marks the image clean");
+
+    //a crash between two syncs leaves stale counters behind a dirty flag
+    set_raw_sb_field(offsetof(SuperBlock, free_blocks), 1);
+    set_raw_sb_field(offsetof(SuperBlock, free_inodes), 2);
+    set_raw_sb_field(offsetof(SuperBlock, state), SB_STATE_DIRTY);
+    u32 fb2, fi2;
+    check(load_fs() == 0, "load a dirty image");
+    fs_counters(&fb2, &fi2);
+    check(fb2 == fb && fi2 == fi, "dirty mount recounts blocks and inodes");
+    check(unload_fs() == 0 && raw_sb_field(offsetof(SuperBlock, free_blocks)) == fb,
+          "recounted values reach the disk on unload");
+
+    //a clean image is trusted as is, that is the fast path
+    set_raw_sb_field(offsetof(SuperBlock, free_blocks), fb - 1);
+    check(load_fs() == 0, "load a clean image");
+    fs_counters(&fb2, NULL);
+    check(fb2 == fb - 1, "clean mount skips the recount");
+    unload_fs();
+    set_raw_sb_field(offsetof(SuperBlock, free_blocks), fb);
+    load_fs();
+}
+
+// ---- one commit per operation ----
+
+static void test_commits(void) {
+    if (fresh_image() < 0) return;
+    u8 data[5 * BLOCK_SIZE];
+    fill(data, sizeof(data), 5);
+    u64 fsyncs = io_counter("fsync", 0);
+    check(fs_create_file("/c") > 0, "create a file");
+    check(io_counter("fsync", 0) - fsyncs == 1, "create commits once");
+    fsyncs = io_counter("fsync", 0);
+    check(fs_write_file("/c", data, sizeof(data)) == (ssize)sizeof(data), "write five blocks");
+    check(io_counter("fsync", 0) - fsyncs == 1, "a five block write commits once");
+
+    //handle writes allocate without syncing, flush writes the metadata
+    FileHandle *fh = fh_open(inode_of("c"));
+    fsyncs = io_counter("fsync", 0);
+    check(fh && fh_write(fh, data, sizeof(data), sizeof(data)) == (ssize)sizeof(data), "extend through a handle");
+    check(io_counter("fsync", 0) == fsyncs, "handle writes do not sync per block");
+    check(fh && fh_flush(fh) == 0 && io_counter("fsync", 0) - fsyncs == 1, "flush commits once");
+    fh_close(fh);
+
+    //nested operations, clone creates the file inside its own commit
+    fsyncs = io_counter("fsync", 0);
+    check(fs_clone_file("/c", "/d") > 0, "clone");
+    check(io_counter("fsync", 0) - fsyncs == 1, "clone commits once");
+    fsyncs = io_counter("fsync", 0);
+    check(fs_read_file("/d", data, sizeof(data)) == (ssize)sizeof(data) && io_counter("fsync", 0) == fsyncs,
+          "a read commits nothing");
+
+    //what was only marked dirty must still reach the disk
+    u32 fb = free_blocks();
+    check(unload_fs() == 0 && load_fs() == 0 && free_blocks() == fb, "counters survive a reload");
+}
+
+// ---- streaming import ----
+
+static int host_file(const char *path, const u8 *data, usize len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int r = host_write_all(fd, data, len);
+    close(fd);
+    return r;
+}
+
+static ssize import_host(const char *host, const char *dst) {
+    int fd = open(host, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize r = fs_import_fd(fd, dst);
+    close(fd);
+    return r;
+}
+
+static void test_import(void) {
+    if (fresh_image() < 0) return;
+    static u8 data[DIRECT_PTRS * BLOCK_SIZE + 1], got[DIRECT_PTRS * BLOCK_SIZE];
+    fill(data, sizeof(data), 3);
+    host_file("src", data, 15000);
+    check(import_host("src", "/in") == 15000, "import a 15000 byte file");
+    check(fs_read_file("/in", got, sizeof(got)) == 15000 && memcmp(got, data, 15000) == 0, "imported bytes match");
+    u32 in = inode_of("in");
+    check(inode_table[in].direct[14] == inode_table[in].direct[0] + 14, "known size lands in one run");
+    check(inode_table[in].direct[15] == 0, "nothing is mapped past the end");
+
+    //a source that cannot fit is refused before the target is touched
+    host_file("big", data, sizeof(data));
+    u32 before = free_blocks();
+    check(import_host("big", "/in") == -EFBIG, "oversized import fails with EFBIG");
+    check(inode_table[in].size == 15000 && free_blocks() == before, "existing target is left alone");
+    check(import_host("big", "/new") == -EFBIG && inode_of("new") == 0, "oversized import creates nothing");
+
+    //a pipe has no size up front, chunks are written as they arrive
+    int fds[2];
+    if (pipe(fds) == 0) {
+        int ok = host_write_all(fds[1], data, 3000) == 0;
+        close(fds[1]);
+        check(ok && fs_import_fd(fds[0], "/in") == 3000, "import from a pipe over an existing file");
+        close(fds[0]);
+        check(fs_read_file("/in", got, sizeof(got)) == 3000 && memcmp(got, data, 3000) == 0 &&
+              inode_table[in].direct[3] == 0, "pipe import replaces the old contents");
+    }
+    unlink("src");
+    unlink("big");
+}
+
+// ---- streaming export ----
+
+static ssize export_host(const char *src, const char *host, u8 *got, usize cap) {
+    int fd = open(host, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    ssize r = fs_export_fd(src, fd);
+    ssize n = r >= 0 ? pread(fd, got, cap, 0) : -1;
+    close(fd);
+    unlink(host);
+    return r == n ? r : -1;
+}
+
+static void test_export(void) {
+    if (fresh_image() < 0) return;
+    static u8 data[DIRECT_PTRS * BLOCK_SIZE], got[DIRECT_PTRS * BLOCK_SIZE + 1];
+    fill(data, sizeof(data), 6);
+    fs_create_file("/full");
+    fs_write_file("/full", data, sizeof(data));
+    check(export_host("/full", "out", got, sizeof(got)) == (ssize)sizeof(data) &&
+          memcmp(got, data, sizeof(data)) == 0, "export a file that uses every pointer");
+
+    //holes come out as zeros and the size is the file size, not the mapped blocks
+    fs_create_file("/sparse");
+    fs_write_file("/sparse", data, 4500);
+    u32 sp = inode_of("sparse");
+    fs_fallocate(sp, FS_FALLOC_KEEP_SIZE | FS_FALLOC_PUNCH_HOLE, BLOCK_SIZE, 2 * BLOCK_SIZE);
+    fs_fallocate(sp, FS_FALLOC_KEEP_SIZE, 8 * BLOCK_SIZE, BLOCK_SIZE);
+    check(export_host("/sparse", "out", got, sizeof(got)) == 4500, "export stops at the file size");
+    check(memcmp(got, data, BLOCK_SIZE) == 0 && all_bytes(got, BLOCK_SIZE, 3 * BLOCK_SIZE, 0) &&
+          memcmp(got + 3 * BLOCK_SIZE, data + 3 * BLOCK_SIZE, 4500 - 3 * BLOCK_SIZE) == 0,
+          "punched blocks export as zeros");
+
+    fs_create_file("/empty");
+    check(export_host("/empty", "out", got, sizeof(got)) == 0, "empty file exports nothing");
+    fs_create_dir("/dir");
+    check(export_host("/dir", "out", got, sizeof(got)) < 0, "a directory cannot be exported");
+    check(export_host("/missing", "out", got, sizeof(got)) < 0, "a missing file cannot be exported");
+}
+
+// ---- batch scripts ----
+
+static int script_file(const char *path, const char *text) {
+    return host_file(path, (const u8 *)text, strlen(text));
+}
+
+static void test_batch(void) {
+    if (fresh_image() < 0) return;
+    host_file("payload", (const u8 *)"batch data", 10);
+    script_file("script", "# comment\n\nmkdir /b\ntouch /b/one\nwrite /b/one payload\nbogus verb\ntouch /b/two\n");
+    u64 fsyncs = io_counter("fsync", 0);
+    check(run_batch("script", 0) == 1, "batch reports the failed line");
+    check(io_counter("fsync", 0) - fsyncs == 1, "batch without -n commits once at the end");
+    u8 got[16];
+    check(fs_read_file("/b/one", got, sizeof(got)) == 10 && memcmp(got, "batch data", 10) == 0,
+          "batch ran every good line");
+    check(inode_of("b") && dir_lookup(&inode_table[inode_of("b")], "two"), "lines after a failure still run");
+
+    script_file("script", "touch /c1\ntouch /c2\ntouch /c3\ntouch /c4\n");
+    fsyncs = io_counter("fsync", 0);
+    check(run_batch("script", 2) == 0, "batch with -n 2");
+    check(io_counter("fsync", 0) - fsyncs == 2, "every second op commits, nothing is left for the end");
+
+    //with the script on stdin, "-" as a data source would eat the script itself
+    script_file("script", "write /b/one -\ntouch /c5\n");
+    int saved = dup(STDIN_FILENO), fd = open("script", O_RDONLY);
+    if (saved >= 0 && fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        check(run_batch("-", 0) == 1, "write from stdin is refused in a stdin script");
+        dup2(saved, STDIN_FILENO);
+        check(fs_read_file("/b/one", got, sizeof(got)) == 10 && inode_of("c5"), "the rest of the script still ran");
+    }
+    if (fd >= 0) close(fd);
+    if (saved >= 0) close(saved);
+    stdin_is_script = 0;
+    unlink("payload");
+    unlink("script");
+}
+
+// ---- recursive delete ----
+
+static void test_rm_tree(void) {
+    if (fresh_image() < 0) return;
+    u8 data[2500];
+    fill(data, sizeof(data), 4);
+    fs_create_file("/keep");
+    u32 fb, fi;
+    fs_counters(&fb, &fi);
+    fs_create_dir("/t");
+    fs_create_dir("/t/x");
+    fs_create_dir("/t/x/y");
+    const char *files[] = { "/t/f", "/t/x/g", "/t/x/y/h", "/t/x/y/i" };
+    for (usize i = 0; i < 4; i++) { fs_create_file(files[i]); fs_write_file(files[i], data, sizeof(data)); }
+    fs_clone_file("/t/f", "/shared"); //one block owner lives outside the tree
+
+    u64 fsyncs = io_counter("fsync", 0);
+    check(fs_delete_dir_recursive("/t") == 0, "rm -r a three level tree");
+    check(io_counter("fsync", 0) - fsyncs == 1, "rm -r commits once");
+    check(inode_of("t") == 0, "parent entry is gone");
+    u32 fb2, fi2;
+    fs_counters(&fb2, &fi2);
+    check(fi2 == fi - 1, "every inode in the tree is freed");
+    check(fb2 == fb - 3 - REFCOUNT_BLOCKS, "only the blocks the clone still owns stay allocated");
+    u8 got[2500];
+    check(fs_read_file("/shared", got, sizeof(got)) == (ssize)sizeof(got) && memcmp(got, data, sizeof(got)) == 0,
+          "clone outside the tree keeps its data");
+    check(fs_delete_dir_recursive("/") < 0, "root cannot be removed");
+    check(fs_delete_dir_recursive("/missing") < 0, "missing path fails");
+}
+
+// ---- path cache ----
+
+static int path_is(u32 ino, const char *want) {
+    char buf[FS_PATH_MAX];
+    return fs_path_of(ino, buf, sizeof(buf)) == (ssize)strlen(want) && strcmp(buf, want) == 0;
+}
+
+static void test_path_cache(void) {
+    if (fresh_image() < 0) return;
+    fs_create_dir("/a");
+    fs_create_dir("/a/b");
+    fs_create_file("/a/b/f");
+    u32 a = inode_of("a");
+    u32 b = dir_lookup(&inode_table[a], "b");
+    u32 f = dir_lookup(&inode_table[b], "f");
+    check(path_is(0, "/"), "root path");
+    check(path_is(f, "/a/b/f"), "nested file path");
+    check(path_is(f, "/a/b/f"), "same path again from the cached parents");
+    char small[6];
+    check(fs_path_of(f, small, sizeof(small)) < 0, "too small a buffer fails");
+
+    //renaming a directory changes every path below it
+    fs_rename("/a", "/z");
+    check(path_is(f, "/z/b/f") && path_is(b, "/z/b"), "paths follow a directory rename");
+
+    //a removed directory number can come back somewhere else
+    fs_unlink("/z/b/f");
+    fs_unlink("/z/b");
+    fs_create_dir("/other");
+    u32 o = inode_of("other");
+    check(o == b && path_is(o, "/other"), "reused directory inode gets its new path");
+    check(fs_path_of(f, small, sizeof(small)) < 0, "freed inode has no path");
+}
+
+// ---- find ----
+
+//run one of the find commands with stdout going to a scratch file, returns the output
+static const char* find_output(void (*find)(const char *), const char *pattern) {
+    static char out[4096];
+    out[0] = '\0';
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open("find.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (saved < 0 || fd < 0) { if (saved >= 0) close(saved); if (fd >= 0) close(fd); return out; }
+    dup2(fd, STDOUT_FILENO);
+    find(pattern);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    ssize n = pread(fd, out, sizeof(out) - 1, 0);
+    out[n > 0 ? n : 0] = '\0';
+    close(fd);
+    unlink("find.out");
+    return out;
+}
+
+//out lists exactly the given paths, in any order
+static int finds(const char *out, const char *const *paths, int n) {
+    int hits = 0;
+    for (const char *p = out; (p = strstr(p, "Found: ")); p++) hits++;
+    if (hits != n) return 0;
+    char line[FS_PATH_MAX + 16];
+    for (int i = 0; i < n; i++) {
+        snprintf(line, sizeof(line), "Found: %s\n", paths[i]);
+        if (!strstr(out, line)) return 0;
+    }
+    return 1;
+}
+
+#define FINDS(out, ...) finds(out, (const char *const[]){ __VA_ARGS__ }, \
+                              (int)(sizeof((const char *const[]){ __VA_ARGS__ }) / sizeof(const char *)))
+
+static void find_cases(const char *how) {
+    char what[128];
+    snprintf(what, sizeof(what), "regex with a required literal, %s", how);
+    check(FINDS(find_output(fs_find_paths, "rep.*\\.c$"), "/src/rep.c"), what);
+    snprintf(what, sizeof(what), "regex with a repeated char, %s", how);
+    check(FINDS(find_output(fs_find_paths, "a+b"), "/docs/aab.txt", "/ab"), what);
+    snprintf(what, sizeof(what), "regex alternation skips the prefilter, %s", how);
+    check(FINDS(find_output(fs_find_paths, "main|readme"), "/src/main.c", "/docs/readme"), what);
+    snprintf(what, sizeof(what), "glob with a star, %s", how);
+    check(FINDS(find_output(fs_find_glob, "rep*"), "/src/rep.c", "/src/repo.h"), what);
+    snprintf(what, sizeof(what), "glob with a bracket, %s", how);
+    check(FINDS(find_output(fs_find_glob, "[ab]ab*"), "/docs/aab.txt"), what);
+    snprintf(what, sizeof(what), "glob with only wildcards, %s", how);
+    check(FINDS(find_output(fs_find_glob, "*.?"), "/src/main.c", "/src/rep.c", "/src/repo.h"), what);
+    snprintf(what, sizeof(what), "substring, %s", how);
+    check(FINDS(find_output(fs_find_substring, "ead"), "/docs/readme"), what);
+    snprintf(what, sizeof(what), "substring with no hit, %s", how);
+    check(!strstr(find_output(fs_find_substring, "zzz"), "Found: "), what);
+}
+
+static void test_find(void) {
+    if (fresh_image() < 0) return;
+    fs_create_dir("/src");
+    fs_create_dir("/docs");
+    const char *files[] = { "/src/main.c", "/src/rep.c", "/src/repo.h", "/docs/aab.txt", "/docs/readme", "/ab" };
+    for (usize i = 0; i < sizeof(files) / sizeof(files[0]); i++) fs_create_file(files[i]);
+    //the table scan with the memmem prefilter, then the same answers through the index
+    find_cases("table scan");
+    check(nameidx_rebuild() == 0, "build the name index");
+    find_cases("indexed");
+}
+
+// ---- trigram name index ----
+
+static int has_candidate(const char *lit, u32 ino) {
+    u64 bits[MAX_INODES / 64];
+    if (nameidx_candidates(lit, strlen(lit), bits) < 0) return -1;
+    return (bits[ino / 64] >> (ino % 64)) & 1;
+}
+
+static void test_nameidx(void) {
+    if (fresh_image() < 0) return;
+    fs_create_file("/alpha.txt");
+    check(nameidx_rebuild() == 0 && nameidx_enabled(), "build the name index");
+    u32 a = inode_of("alpha.txt");
+    check(has_candidate("pha", a) == 1, "existing name is indexed");
+    check(has_candidate("ab", a) < 0, "literal shorter than a trigram is not answered");
+
+    u64 written = io_counter("index", 3);
+    fs_create_file("/beta.log");
+    u32 b = inode_of("beta.log");
+    u64 cost = io_counter("index", 3) - written;
+    check(has_candidate("ta.l", b) == 1, "new file is indexed");
+    check(cost > 0 && cost < (u64)NAME_INDEX_BLOCKS * BLOCK_SIZE / 4,
+          "a create writes only the index blocks it changed");
+
+    fs_rename("/beta.log", "/gamma.log");
+    check(has_candidate("amm", b) == 1 && has_candidate("bet", b) == 0, "rename moves the trigrams");
+    fs_unlink("/alpha.txt");
+    check(has_candidate("pha", a) == 0, "unlink drops the inode");
+
+    //what reached the disk is what a reload sees
+    check(unload_fs() == 0 && load_fs() == 0, "reload the image");
+    check(has_candidate("amm", b) == 1 && has_candidate("pha", a) == 0, "index survives the reload");
+}
+
+// ---- per thread i/o counters ----
+
+static void* read_some(void *arg) {
+    u8 blk[BLOCK_SIZE];
+    for (int i = 0; i < 3; i++) read_blocks(sb.data_block_start, 1, blk);
+    return arg;
+}
+
+static void test_ioacct(void) {
+    if (fresh_image() < 0) return;
+    u64 before = io_counter("data", 0);
+    int ok = 1;
+    //more threads than fuse keeps around at once, each exits before the next starts
+    for (int i = 0; i < 64 && ok; i++) {
+        pthread_t th;
+        ok = pthread_create(&th, NULL, read_some, NULL) == 0 && pthread_join(th, NULL) == 0;
+    }
+    check(ok, "start and join reader threads");
+    check(io_counter("data", 0) - before == 64 * 3, "reads of exited threads are still counted");
+}
+
+int main(void) {
+    char dir[] = "/tmp/vdisk_test.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) { perror("test: scratch dir"); return 1; }
+
+    test_clone();
+    test_stale_handle();
+    test_truncate();
+    test_recount();
+    test_commits();
+    test_import();
+    test_export();
+    test_batch();
+    test_rm_tree();
+    test_path_cache();
+    test_find();
+    test_nameidx();
+    test_ioacct();
+
+    unload_fs();
+    unlink(DISK_PATH);
+    if (chdir("/") == 0) rmdir(dir);
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
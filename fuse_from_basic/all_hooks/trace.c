@@ -0,0 +1,121 @@
+#include"virt_disk.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<fcntl.h>
+#include<pthread.h>
+
+// binary operation trace: an 8 byte magic, then one TraceRec per operation followed by
+// its path bytes (and the second path for rename/clone). records are collected in a
+// buffer under a lock and written out when it fills, so tracing costs a memcpy per op
+#define TRACE_BUF (256 * 1024)
+
+static const char trace_magic[8] = { 'V','D','T','R','A','C','E','1' };
+
+static int trace_fd = -1;
+static u64 trace_start;
+static u8 *tbuf;
+static usize tlen;
+static int trace_blocks;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int trace_enabled(void) {
+  return trace_fd >= 0;
+}
+
+int trace_open(const char *host_path) {
+  if (trace_fd >= 0) return -1;
+  tbuf = malloc(TRACE_BUF);
+  if (!tbuf) return -1;
+  int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || host_write_all(fd, (const u8 *)trace_magic, sizeof(trace_magic)) < 0) {
+    if (fd >= 0) close(fd);
+    free(tbuf);
+    tbuf = NULL;
+    return -1;
+  }
+  tlen = 0;
+  trace_start = stats_now();
+  trace_fd = fd;
+  return 0;
+}
+
+static void flush_locked(void) {
+  if (tlen && host_write_all(trace_fd, tbuf, tlen) < 0) {
+    fprintf(stderr, "trace: write failed, trace is incomplete\n");
+  }
+  tlen = 0;
+}
+
+void trace_record(u16 op, u64 start_ns, const char *path, const char *path2,
+                  u32 ino, u64 off, u64 len, u32 mode, int result) {
+  if (trace_fd < 0) return;
+  TraceRec r;
+  memset(&r, 0, sizeof(r));
+  r.ts_ns = start_ns > trace_start ? start_ns - trace_start : 0;
+  r.off = off;
+  r.len = len;
+  r.result = result;
+  r.ino = ino;
+  r.op = op;
+  r.mode = (u16)mode;
+  r.path_len = path ? (u16)strnlen(path, TRACE_MAX_PATH) : 0;
+  r.path2_len = path2 ? (u16)strnlen(path2, TRACE_MAX_PATH) : 0;
+  usize need = sizeof(r) + r.path_len + r.path2_len;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0) {
+    if (tlen + need > TRACE_BUF) flush_locked();
+    memcpy(tbuf + tlen, &r, sizeof(r));
+    memcpy(tbuf + tlen + sizeof(r), path, r.path_len);
+    memcpy(tbuf + tlen + sizeof(r) + r.path_len, path2, r.path2_len);
+    tlen += need;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_set_blocks(int on) {
+  trace_blocks = on;
+}
+
+//block accesses for the cache simulator, hits and misses alike
+void trace_block(u16 op, u32 block_idx) {
+  if (!trace_blocks || trace_fd < 0) return;
+  trace_record(op, stats_now(), NULL, NULL, TRACE_NO_INO, block_idx, BLOCK_SIZE, 0, 0);
+}
+
+void trace_close(void) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0) {
+    flush_locked();
+    close(trace_fd);
+    trace_fd = -1;
+    free(tbuf);
+    tbuf = NULL;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+//reading side, for replay and the cache simulator
+FILE* trace_read_open(const char *host_path) {
+  FILE *f = fopen(host_path, "rb");
+  if (!f) return NULL;
+  char magic[sizeof(trace_magic)];
+  if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, trace_magic, sizeof(magic)) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+//next record, paths come back nul terminated. 1 on success, 0 at the end, -1 if corrupt
+int trace_next(FILE *f, TraceRec *r, char *path, char *path2) {
+  usize got = fread(r, 1, sizeof(*r), f);
+  if (got == 0) return 0;
+  if (got != sizeof(*r) || r->path_len > TRACE_MAX_PATH || r->path2_len > TRACE_MAX_PATH) return -1;
+  if (fread(path, 1, r->path_len, f) != r->path_len) return -1;
+  if (fread(path2, 1, r->path2_len, f) != r->path2_len) return -1;
+  path[r->path_len] = '\0';
+  path2[r->path2_len] = '\0';
+  return 1;
+}
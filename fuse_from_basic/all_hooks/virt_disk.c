@@ -4,10 +4,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdint.h>
+#include <pthread.h>
 typedef uint8_t u8;
 typedef uint32_t u32;
 typedef uint64_t u64;
@@ -18,12 +20,19 @@ SuperBlock sb;
 Inode inode_table[MAX_INODES];
 u8 block_bitmap[TOTAL_BLOCKS/8 + 1];
 int disk_fd = -1;
+u32 inode_gen[MAX_INODES];
+u32 inode_epoch[MAX_INODES];
+u8 block_refs[TOTAL_BLOCKS];
+
+// guards the bitmap, the inode used flags and the superblock free counters 
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static ssize write_data(int fd, const void *buf, usize count, off_t offset) {
     usize written = 0;
     u8 *p = (u8*)buf;//since but was void* need to type cast it
     while (written < count) {
         ssize w = pwrite(fd, p + written, count - written, offset + (off_t)written);
+        io_account(1, offset + (off_t)written, count - written, w);
         if (w < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -41,6 +50,7 @@ static ssize read_data(int fd, void *buf, usize count, off_t offset) {
     u8 *p = (u8*)buf;
     while (done < count) {
         ssize r = pread(fd, p + done, count - done, offset + (off_t)done);
+        io_account(0, offset + (off_t)done, count - done, r);
         if (r < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -52,10 +62,38 @@ static ssize read_data(int fd, void *buf, usize count, off_t offset) {
 }
 // read function (loop until all bytes read or error/eof) 
 
+//pwritev until every iovec is written, advances the vector in place on short writes
+static ssize writev_data(int fd, struct iovec *iov, int cnt, off_t offset) {
+    usize written = 0;
+    while (cnt > 0) {
+        usize want = 0;
+        for (int i = 0; i < cnt; i++) want += iov[i].iov_len;
+        ssize w = pwritev(fd, iov, cnt, offset + (off_t)written);
+        io_account(1, offset + (off_t)written, want, w);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (w == 0) break;
+        written += (usize)w;
+        usize left = (usize)w;
+        while (cnt > 0 && left >= iov->iov_len) { left -= iov->iov_len; iov++; cnt--; }
+        if (cnt > 0) { iov->iov_base = (u8*)iov->iov_base + left; iov->iov_len -= left; }
+    }
+    return (ssize)written;
+}
+
 // format the virtual disk file and initialize metdata
+// superblock, inode table and bitmap are contiguous, so they are built in memory and go
+// out in one vectored write. the data area is never written, ftruncate leaves it sparse
 int format_fs() {
+    return format_fs_opts(0);
+}
+
+int format_fs_opts(u32 opts) {
     int fd = open(DISK_PATH, O_RDWR | O_CREAT | O_TRUNC, 0666);
     if (fd < 0) return -1; //failed to create the disk
+    bcache_reset(); //cached blocks belong to the old image
 
     //first remove all garbage data from disk 
     u64 target_size = DISK_SIZE;
@@ -93,120 +131,154 @@ int format_fs() {
     printf("debug: block_bitmap_block     = %u\n", sb.block_bitmap_block);
     printf("debug: data_block_start       = %u\n", sb.data_block_start);
 
+    memset(block_refs, 0, sizeof(block_refs));
     sb.free_blocks = sb.total_blocks - sb.data_block_start;
     sb.free_inodes = sb.total_inodes - 1; // reserve inode 0 for root 
-
-    // write superblock 
-    if (write_data(fd, &sb, sizeof(sb), 0) != (ssize)sizeof(sb)) { 
-        close(fd); 
-        return -1; 
+    sb.state = SB_STATE_CLEAN;
+    if (opts & FORMAT_LAZY_ITABLE) sb.feature_flags |= SB_F_LAZY_ITABLE;
+
+    // inode table and bitmap regions, block aligned so the vector maps straight onto blocks 
+    usize itable_bytes = (usize)inode_table_blocks * BLOCK_SIZE;
+    usize bitmap_bytes = (usize)bitmap_blocks * BLOCK_SIZE;
+    u8 *meta = NULL;
+    if (posix_memalign((void**)&meta, BLOCK_SIZE, itable_bytes + bitmap_bytes) != 0) {
+        close(fd);
+        return -1;
     }
-
-    // Create and write empty inode table 
-    Inode empty_inode;
-    memset(&empty_inode, 0, sizeof(empty_inode));
-    off_t inode_pos = (off_t)sb.inode_table_block * BLOCK_SIZE; //offset byte position 
-
-    for (u32 i = 0; i < (u32)MAX_INODES; ++i) {
-        empty_inode.id = i;   
-        if (write_data(fd, &empty_inode, sizeof(empty_inode), 
-                       inode_pos + (off_t)i * sizeof(Inode)) != (ssize)sizeof(Inode)) {
-            //base address + offset here base_addr = inode_pos , offset = i * sizeof(Inode)
-	    //where starting from i=1 since first one written for root inode
-            close(fd);
-            return -1;
-        }
+    memset(meta, 0, itable_bytes + bitmap_bytes);
+    Inode *itable = (Inode*)meta;
+    u8 *bitmap_buf = meta + itable_bytes;
+
+    for (u32 i = 0; i < (u32)MAX_INODES; ++i) itable[i].id = i;
+    // root inode 
+    itable[0].used = 1;
+    itable[0].is_dir = 1;
+    itable[0].size = 0;
+    itable[0].parent = 0;
+    strcpy(itable[0].name,"/");
+
+    // Mark metadata blocks [0, data_block_start) as used, whole bytes first 
+    u32 meta_blocks = sb.data_block_start < sb.total_blocks ? sb.data_block_start : sb.total_blocks;
+    memset(bitmap_buf, 0xff, meta_blocks / 8);
+    for (u32 block = meta_blocks & ~7u; block < meta_blocks; ++block) {
+        bitmap_buf[block / 8] |= (u8)(1u << (block % 8));
     }
 
-    // Initialize and write bitmap - mark metadata blocks as used 
-    usize bitmap_bytes = (sb.total_blocks + 7) / 8;
-    usize bitmap_blocks_needed = (bitmap_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    usize full_bitmap_bytes = bitmap_blocks_needed * BLOCK_SIZE;
-    
-    u8 *bitmap_buf = calloc(1, full_bitmap_bytes);
-    if (!bitmap_buf) { 
-        close(fd); 
-        return -1; 
-    }
-
-    // Mark metadata blocks [0, data_block_start) as used 
-    for (u32 block = 0; block < sb.data_block_start && block < sb.total_blocks; ++block) {
-        usize byte_index = block / 8;
-        usize bit_index = block % 8;
-        if (byte_index < full_bitmap_bytes) {
-            bitmap_buf[byte_index] |= (u8)(1u << bit_index);
+    // superblock, inode table and bitmap in one call. lazy format only writes the root's 
+    // inode block, the rest of the table is a hole that reads back as zeroes 
+    struct iovec iov[3] = {
+        { &sb, sizeof(sb) },
+        { itable, (opts & FORMAT_LAZY_ITABLE) ? BLOCK_SIZE : itable_bytes },
+        { bitmap_buf, bitmap_bytes },
+    };
+    usize head = iov[0].iov_len + iov[1].iov_len;
+    ssize w;
+    if (opts & FORMAT_LAZY_ITABLE) {
+        w = writev_data(fd, iov, 2, 0);
+        if (w == (ssize)head) {
+            off_t bitmap_pos = (off_t)sb.block_bitmap_block * BLOCK_SIZE;
+            w = write_data(fd, bitmap_buf, bitmap_bytes, bitmap_pos) == (ssize)bitmap_bytes ? (ssize)(head + bitmap_bytes) : -1;
         }
+    } else {
+        w = writev_data(fd, iov, 3, 0);
     }
-
-    // Write bitmap blocks 
-    off_t bitmap_pos = (off_t)sb.block_bitmap_block * BLOCK_SIZE;
-    if (write_data(fd, bitmap_buf, full_bitmap_bytes, bitmap_pos) != (ssize)full_bitmap_bytes) {
-        free(bitmap_buf); 
-        close(fd); 
-        return -1;
-    }
-    free(bitmap_buf);
-
-    // Create root inode 
-    Inode root_inode;
-    memset(&root_inode, 0, sizeof(root_inode));
-    root_inode.id = 0;
-    root_inode.used = 1;
-    root_inode.is_dir = 1;
-    root_inode.size = 0;
-    root_inode.parent = 0;
-    strcpy(root_inode.name,"/");
-
-    // Write root inode 
-    if (write_data(fd, &root_inode, sizeof(root_inode), 
-                   inode_pos + (off_t)0 * sizeof(Inode)) != (ssize)sizeof(root_inode)) {
+    free(meta);
+    if (w != (ssize)(head + bitmap_bytes)) {
         close(fd);
         return -1;
     }
 
     // flush to disk 
+    io_account_fsync();
     if (fsync(fd) < 0) { 
         close(fd); 
         return -1; 
     }
 
     close(fd);
-    
-/*    printf("Filesystem formatted successfully!\n");
-    printf("Final layout: superblock(0), Inodetabel(1-%u), Bitmap(%u), Datablocks(%u-%u)\n",
-           sb.inode_table_block + inode_table_blocks - 1,
-           sb.block_bitmap_block,
-           sb.data_block_start, 
-           sb.total_blocks - 1);
-*/    
     return 0;
 }
 
+// state of the image on disk: what load_fs found, SB_STATE_DIRTY once this process 
+// has written metadata, SB_STATE_CLEAN again after unload_fs 
+static u32 disk_state = SB_STATE_CLEAN;
+
+static int load_failed(int reload) {
+    if (!reload) {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    return -1;
+}
+
+//rebuild the free counters from the bitmap and the used flags after an unclean shutdown 
+static void recount_free(void) {
+    usize bytes = (sb.total_blocks + 7) / 8, i = 0;
+    u32 used_blocks = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        u64 w;
+        memcpy(&w, block_bitmap + i, 8);
+        used_blocks += (u32)__builtin_popcountll(w);
+    }
+    for (; i < bytes; i++) {
+        u8 b = block_bitmap[i];
+        if (i == bytes - 1 && (sb.total_blocks & 7)) b &= (u8)((1u << (sb.total_blocks & 7)) - 1);
+        used_blocks += (u32)__builtin_popcount(b);
+    }
+    u32 used_inodes = 0;
+    for (u32 n = 0; n < MAX_INODES; n++) used_inodes += inode_table[n].used != 0;
+
+    u32 fb = sb.total_blocks - used_blocks, fi = sb.total_inodes - used_inodes;
+    if (fb != sb.free_blocks || fi != sb.free_inodes) {
+        fprintf(stderr, "fs: image was not unmounted cleanly, free blocks %u -> %u, free inodes %u -> %u\n",
+                sb.free_blocks, fb, sb.free_inodes, fi);
+    }
+    sb.free_blocks = fb;
+    sb.free_inodes = fi;
+}
+
 // load metadata into memory - only superblock
 int load_fs() {
-    disk_fd = open(DISK_PATH, O_RDWR);
-    if (disk_fd < 0) return -1;
+    //a reload keeps the descriptor other threads and the readahead worker may be using
+    //and only rereads the metadata, along with its clean/dirty bookkeeping 
+    int reload = disk_fd >= 0;
+    if (!reload) {
+        disk_fd = open(DISK_PATH, O_RDWR);
+        if (disk_fd < 0) return -1;
+    }
    
     // read superblock 
     ssize r = read_data(disk_fd, &sb, sizeof(sb), 0);
-    if (r != (ssize)sizeof(sb)) { 
-        close(disk_fd); 
-        disk_fd = -1; 
-        return -1;
-    }	
+    if (r != (ssize)sizeof(sb)) return load_failed(reload);
     //if (pread(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) return -1;
-    if (sb.magic != FS_MAGIC) { 
-        close(disk_fd); 
-        disk_fd = -1; 
-        return -1; 
-    }
+    if (sb.magic != FS_MAGIC) return load_failed(reload);
     //if (sb.magic != FS_MAGIC) return -1;
     off_t inode_pos = sb.inode_table_block * BLOCK_SIZE;
-    if (read_data(disk_fd, &inode_table, sizeof(inode_table), inode_pos) != sizeof(inode_table)) return -1;
+    if (read_data(disk_fd, &inode_table, sizeof(inode_table), inode_pos) != sizeof(inode_table)) return load_failed(reload);
+    if (sb.feature_flags & SB_F_LAZY_ITABLE) {
+        //the hole read back as zeroes, the next sync writes the whole table 
+        for (u32 i = 0; i < MAX_INODES; ++i) inode_table[i].id = i;
+        sb.feature_flags &= ~SB_F_LAZY_ITABLE;
+    }
+    for (u32 i = 0; i < MAX_INODES; ++i) touch_inode(i); //table reread, cached block maps are stale
+    path_cache_invalidate();
     
     int bitmap_bytes = (sb.total_blocks + 7)/8;
     off_t bitmap_pos = sb.block_bitmap_block * BLOCK_SIZE;
-    if (read_data(disk_fd, &block_bitmap, bitmap_bytes, bitmap_pos) != bitmap_bytes) return -1;
+    if (read_data(disk_fd, &block_bitmap, bitmap_bytes, bitmap_pos) != bitmap_bytes) return load_failed(reload);
+    memset(block_refs, 0, sizeof(block_refs));
+    if (sb.refcount_block) {
+        off_t refs_pos = (off_t)sb.refcount_block * BLOCK_SIZE;
+        if (read_data(disk_fd, block_refs, sizeof(block_refs), refs_pos) != sizeof(block_refs)) return load_failed(reload);
+    }
+    if (nameidx_load() < 0) return load_failed(reload);
+
+    //a clean image is trusted as is, anything else may have died between two syncs 
+    if (!reload) {
+        disk_state = sb.state;
+        if (disk_state != SB_STATE_CLEAN) recount_free();
+    }
+    sb.state = SB_STATE_DIRTY; //every metadata write from now on says so 
     return 0;
 }
 /*
@@ -246,22 +318,99 @@ void fs_info() {
 }
 
 
-int sync_metadata() {
-    if (disk_fd < 0) return -1;
+// while deferred, sync_metadata only marks metadata dirty and fs_commit writes it.
+// deferral belongs to the calling thread, so a long rm -r or import in one fuse thread
+// never holds back the syncs of the others. meta_lock keeps whole metadata writes apart
+static __thread int sync_deferred;
+static int meta_dirty;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int fs_defer_sync(int on) {
+    int was = sync_deferred;
+    sync_deferred = on;
+    return was;
+}
+
+int fs_commit() {
+    if (!meta_dirty) return 0;
+    int saved = sync_deferred;
+    sync_deferred = 0;
+    int r = sync_metadata();
+    sync_deferred = saved;
+    return r;
+}
+
+static int write_metadata(void) {
+    disk_state = sb.state;
     if (write_data(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) return -1;
     off_t inode_pos = sb.inode_table_block * BLOCK_SIZE;
     if (write_data(disk_fd, &inode_table, sizeof(inode_table), inode_pos) != sizeof(inode_table)) return -1;
     int bitmap_bytes = (sb.total_blocks + 7)/8;
     off_t bitmap_pos = sb.block_bitmap_block * BLOCK_SIZE;
     if (write_data(disk_fd, &block_bitmap, bitmap_bytes, bitmap_pos) != bitmap_bytes) return -1;
-    fsync(disk_fd);
-    return 0;
+    if (sb.refcount_block) {
+        off_t refs_pos = (off_t)sb.refcount_block * BLOCK_SIZE;
+        if (write_data(disk_fd, block_refs, sizeof(block_refs), refs_pos) != sizeof(block_refs)) return -1;
+    }
+    if (nameidx_save() < 0) return -1;
+    u64 t0 = stats_now();
+    FS_PROBE1(fsync__entry, disk_fd);
+    int fr = fsync(disk_fd);
+    io_account_fsync();
+    stats_record(ST_FSYNC, t0);
+    FS_PROBE2(fsync__return, disk_fd, fr);
+    return fr < 0 ? -1 : 0;
+}
+
+int sync_metadata() {
+    if (disk_fd < 0) return -1;
+    if (sync_deferred) {
+        meta_dirty = 1;
+        return 0;
+    }
+    u64 t0 = stats_now();
+    FS_PROBE0(sync__entry);
+    pthread_mutex_lock(&meta_lock);
+    meta_dirty = 0;
+    int r = write_metadata();
+    pthread_mutex_unlock(&meta_lock);
+    stats_record(ST_SYNC_METADATA, t0);
+    FS_PROBE1(sync__return, r);
+    return r;
+}
+
+// orderly unmount. pending metadata goes out still marked dirty, then the superblock 
+// alone is rewritten as clean, so a crash in between never leaves a clean flag on a 
+// half written table 
+int unload_fs() {
+    if (disk_fd < 0) return -1;
+    int r = 0;
+    sync_deferred = 0;
+    if (meta_dirty) r = sync_metadata();
+    if (r == 0 && disk_state != SB_STATE_CLEAN) {
+        sb.state = SB_STATE_CLEAN;
+        if (write_data(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) r = -1;
+        if (r == 0) {
+            io_account_fsync();
+            if (fsync(disk_fd) < 0) r = -1;
+        }
+        if (r == 0) disk_state = SB_STATE_CLEAN;
+        else sb.state = SB_STATE_DIRTY;
+    }
+    close(disk_fd);
+    disk_fd = -1;
+    return r;
 }
 
 
+// the allocators only mark metadata dirty, the fs_* operation that called them
+// writes it once when it is done, so a multi block write costs one fsync 
+
 // allocate a free inode, return inode id or -1 
 int allocate_inode() {
     int i = 1;
+    pthread_mutex_lock(&alloc_lock);
+    if (sb.free_inodes == 0) i = MAX_INODES; //no need to scan a full table
     // starting  from 1 (0 is root) 
     while( i < MAX_INODES ){
         if (!inode_table[i].used) {
@@ -271,60 +420,209 @@ int allocate_inode() {
             inode_table[i].parent = 0;
             memset(inode_table[i].direct, 0, sizeof(inode_table[i].direct));
             memset(inode_table[i].name, 0, sizeof(inode_table[i].name));
+            touch_inode(i);
             sb.free_inodes--;
-            sync_metadata();
+            meta_dirty = 1;
+            pthread_mutex_unlock(&alloc_lock);
             return i;
         }
 	i++;
     }
+    pthread_mutex_unlock(&alloc_lock);
     return -1;
 }
 
-// free inode 
-int free_inode(u32 ino) {
-    if (ino <= 0 || ino >= MAX_INODES) return -1;
+//drop one owner of a data block, caller holds alloc_lock 
+static void release_block_locked(u32 block_idx) {
+    if (block_idx < sb.data_block_start || block_idx >= sb.total_blocks) return;
+    if (block_refs[block_idx]) {
+        block_refs[block_idx]--;
+    } else if (test_bitmap(block_idx)) {
+        clear_bitmap(block_idx);
+        sb.free_blocks++;
+    }
+}
+
+//return the blocks and the slot of one inode, caller holds alloc_lock 
+static int release_inode_locked(u32 ino) {
     Inode *in = &inode_table[ino];
-    //free blocks
-    u32 i = 0;
-    while(i < DIRECT_PTRS){
+    for (u32 i = 0; i < DIRECT_PTRS; i++) {
         if (in->direct[i]) {
-            clear_bitmap(in->direct[i]);
-            sb.free_blocks +=1;
+            release_block_locked(in->direct[i]);
             in->direct[i] = 0;
         }
-	i++;
-    } 
+    }
+    int was_dir = in->used && in->is_dir;
+    if (in->used) {
+        sb.free_inodes +=1;
+        inode_epoch[ino]++; //open handles on this inode are stale from here on
+    }
     in->used = 0;
     in->size = 0;
     memset(in->name, 0, sizeof(in->name));
-    sb.free_inodes +=1;
+    touch_inode(ino);
+    return was_dir;
+}
+
+// free inode 
+int free_inode(u32 ino) {
+    if (ino <= 0 || ino >= MAX_INODES) return -1;
+    nameidx_remove(ino);
+    pthread_mutex_lock(&alloc_lock);
+    int was_dir = release_inode_locked(ino);
+    pthread_mutex_unlock(&alloc_lock);
+    if (was_dir) path_cache_invalidate(); //the inode number may come back as another dir
+    return sync_metadata();
+}
+
+//free a whole set of inodes in one pass over the table and bitmap with a single
+//metadata write, the caller has already unlinked them from the tree 
+int free_inodes(const u32 *inos, usize n) {
+    int any_dir = 0;
+    for (usize k = 0; k < n; k++) {
+        if (inos[k] > 0 && inos[k] < MAX_INODES) nameidx_remove(inos[k]);
+    }
+    pthread_mutex_lock(&alloc_lock);
+    for (usize k = 0; k < n; k++) {
+        if (inos[k] <= 0 || inos[k] >= MAX_INODES) continue;
+        any_dir |= release_inode_locked(inos[k]);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (any_dir) path_cache_invalidate();
     return sync_metadata();
 }
 
 //allocate one free block, return block idx or 0 on error (0 reserved) 
 u32 allocate_block() {
     u32 b = sb.data_block_start;
+    pthread_mutex_lock(&alloc_lock);
+    if (sb.free_blocks == 0) b = sb.total_blocks; //full, skip the scan
     while(b < sb.total_blocks){
         if (!test_bitmap(b)) {
             set_bitmap(b);
             sb.free_blocks--;
-            sync_metadata();
+            meta_dirty = 1;
+            pthread_mutex_unlock(&alloc_lock);
             return b;
         }
 	b++;	
     }
+    pthread_mutex_unlock(&alloc_lock);
     return 0;
 }
 
+//allocate count adjacent blocks, return the first one or 0 if no run is long enough
+u32 allocate_run(u32 count) {
+    if (count == 0) return 0;
+    pthread_mutex_lock(&alloc_lock);
+    u32 run_start = 0, run_len = 0;
+    if (sb.free_blocks >= count) {
+        for (u32 b = sb.data_block_start; b < sb.total_blocks; b++) {
+            if (test_bitmap(b)) { run_len = 0; continue; }
+            if (run_len == 0) run_start = b;
+            if (++run_len == count) break;
+        }
+    }
+    if (run_len < count) {
+        pthread_mutex_unlock(&alloc_lock);
+        return 0;
+    }
+    for (u32 b = run_start; b < run_start + count; b++) set_bitmap(b);
+    sb.free_blocks -= count;
+    meta_dirty = 1;
+    pthread_mutex_unlock(&alloc_lock);
+    return run_start;
+}
+
+//drop one owner of a block, it only goes back to the free pool with the last owner
+void free_block(u32 block_idx) {
+    pthread_mutex_lock(&alloc_lock);
+    release_block_locked(block_idx);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+//add one owner to an allocated block, -1 when the refcount is maxed out
+int share_block(u32 block_idx) {
+    if (block_idx < sb.data_block_start || block_idx >= sb.total_blocks) return -1;
+    if (!sb.refcount_block) {
+        //first clone on this image, give the refcount table a home
+        u32 b = allocate_run(REFCOUNT_BLOCKS);
+        if (!b) return -1;
+        pthread_mutex_lock(&alloc_lock);
+        int lost = sb.refcount_block != 0;
+        if (!lost) sb.refcount_block = b;
+        pthread_mutex_unlock(&alloc_lock);
+        if (lost) { //someone else won the race
+            for (u32 i = 0; i < REFCOUNT_BLOCKS; i++) free_block(b + i);
+        }
+    }
+    pthread_mutex_lock(&alloc_lock);
+    int r = -1;
+    if (test_bitmap(block_idx) && block_refs[block_idx] < MAX_BLOCK_REFS) {
+        block_refs[block_idx]++;
+        r = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return r;
+}
+
+int block_shared(u32 block_idx) {
+    if (block_idx >= TOTAL_BLOCKS) return 0;
+    pthread_mutex_lock(&alloc_lock);
+    int r = block_refs[block_idx] != 0;
+    pthread_mutex_unlock(&alloc_lock);
+    return r;
+}
+
+//snapshot of the free counters, they are maintained by every alloc/free so this never scans
+void fs_counters(u32 *free_blocks, u32 *free_inodes) {
+    pthread_mutex_lock(&alloc_lock);
+    if (free_blocks) *free_blocks = sb.free_blocks;
+    if (free_inodes) *free_inodes = sb.free_inodes;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
 // helper read/write a block 
 ssize read_block(u32 block_idx, void *buf) {
     if (block_idx >= sb.total_blocks) return -1;
-    off_t pos = (off_t)block_idx * BLOCK_SIZE;
-    return read_data(disk_fd, buf, BLOCK_SIZE, pos); //returns read bytes 
+    u64 t0 = stats_now();
+    ssize r = BLOCK_SIZE;
+    FS_PROBE1(block_read__entry, block_idx);
+    trace_block(TR_BLOCK_READ, block_idx);
+    if (bcache_get(block_idx, buf)) {
+        FS_PROBE1(cache__hit, block_idx);
+    } else {
+        FS_PROBE1(cache__miss, block_idx);
+        u32 gen = bcache_write_gen(block_idx); //so a racing write is not overwritten by stale data
+        off_t pos = (off_t)block_idx * BLOCK_SIZE;
+        r = read_data(disk_fd, buf, BLOCK_SIZE, pos); //returns read bytes 
+        if (r == BLOCK_SIZE) bcache_fill(block_idx, buf, gen);
+    }
+    stats_record(ST_READ_BLOCK, t0);
+    FS_PROBE2(block_read__return, block_idx, r);
+    return r;
 }
 ssize write_block(u32 block_idx, const void *buf) {
     if (block_idx >= sb.total_blocks) return -1;
     off_t pos = (off_t)block_idx * BLOCK_SIZE;
-    return write_data(disk_fd, buf, BLOCK_SIZE, pos); //returns written bytes
+    FS_PROBE1(block_write__entry, block_idx);
+    trace_block(TR_BLOCK_WRITE, block_idx);
+    ssize w = write_data(disk_fd, buf, BLOCK_SIZE, pos); //returns written bytes
+    if (w == BLOCK_SIZE) bcache_put(block_idx, buf);
+    FS_PROBE2(block_write__return, block_idx, w);
+    return w;
+}
+// read count consecutive blocks with one pread, bypasses the cache 
+ssize read_blocks(u32 block_idx, u32 count, void *buf) {
+    if (block_idx >= sb.total_blocks || count > sb.total_blocks - block_idx) return -1;
+    off_t pos = (off_t)block_idx * BLOCK_SIZE;
+    return read_data(disk_fd, buf, (usize)count * BLOCK_SIZE, pos);
+}
+// write count consecutive blocks with one pwrite, cached copies are dropped 
+ssize write_blocks(u32 block_idx, u32 count, const void *buf) {
+    if (block_idx >= sb.total_blocks || count > sb.total_blocks - block_idx) return -1;
+    for (u32 i = 0; i < count; i++) bcache_drop(block_idx + i);
+    off_t pos = (off_t)block_idx * BLOCK_SIZE;
+    return write_data(disk_fd, buf, (usize)count * BLOCK_SIZE, pos);
 }
 
@@ -5,8 +5,11 @@
 #include <stddef.h> //size_t type and offsetof macro
 #include <unistd.h> // for ssize_t 
 #include <sys/types.h> // off_t (file offset type)
+#include <sys/ioctl.h> // _IOW for the bridge ioctls 
 #include <regex.h>
+#include <stdio.h> // FILE for the trace reader 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 typedef size_t   usize;
@@ -24,10 +27,12 @@ typedef ssize_t  ssize;
 // derived disk size from block size and number of blocks 
 #define DISK_SIZE   ((u64)BLOCK_SIZE * (u64)TOTAL_BLOCKS)
 #define BITMAP_SIZE ((TOTAL_BLOCKS + 7) / 8)  // some additional space intentionaly
+#define REFCOUNT_BLOCKS ((TOTAL_BLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE) // one u8 per block 
+#define MAX_BLOCK_REFS 255  // a block can be shared by at most 256 inodes 
 
 // ---------------- SuperBlock ----------------
 
-#define SB_U32_FIELDS 9  //there are total 9 attributes of superblock
+#define SB_U32_FIELDS 13  //there are total 13 attributes of superblock
 #define SB_FIXED_BYTES (SB_U32_FIELDS * sizeof(u32)) //since all are of size u32
 
 typedef struct SuperBlock {
@@ -40,9 +45,20 @@ typedef struct SuperBlock {
     u32 inode_table_block;   // first block of inode table 
     u32 block_bitmap_block;  // first block of bitmap 
     u32 data_block_start;    // first usable data block 
+    u32 refcount_block;      // first block of shared block refcounts, 0 until first clone 
+    u32 name_index_block;    // first block of the trigram name index, 0 if not built 
+    u32 feature_flags;       // SB_F_* bits, zero on images made before the field existed 
+    u32 state;               // SB_STATE_CLEAN only after an orderly unload_fs 
     uint8_t  reserved[BLOCK_SIZE - SB_FIXED_BYTES];
 } SuperBlock;
 
+// inode table past its first block was left as a hole by format, load_fs fills in the ids 
+#define SB_F_LAZY_ITABLE 0x1
+
+// images from before the state field read as dirty and get their counters rebuilt once 
+#define SB_STATE_DIRTY 0
+#define SB_STATE_CLEAN 1
+
 // SuperBlock must exactly occupy one block 
 _Static_assert(sizeof(SuperBlock) == BLOCK_SIZE,
                "SuperBlock must be exactly one block in size");
@@ -90,12 +106,41 @@ typedef struct DirEntry {
     u32 inode_id;
 } DirEntry;
 
+// ---------------- USDT probes ---------------- 
+
+// static tracepoints for bpftrace/perf under the provider "vdisk", e.g.
+//   bpftrace -e 'usdt:./fuse_mount:vdisk:sync__return { @[arg0] = count(); }'
+// built in whenever sys/sdt.h is found (-DVDISK_NO_USDT leaves them out), a probe
+// nobody is attached to is a single nop. without sdt.h they compile to nothing 
+#if !defined(VDISK_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define VDISK_USDT 1
+#endif
+#endif
+
+#ifdef VDISK_USDT
+#define FS_PROBE0(name)          DTRACE_PROBE(vdisk, name)
+#define FS_PROBE1(name, a)       DTRACE_PROBE1(vdisk, name, a)
+#define FS_PROBE2(name, a, b)    DTRACE_PROBE2(vdisk, name, a, b)
+#define FS_PROBE3(name, a, b, c) DTRACE_PROBE3(vdisk, name, a, b, c)
+#else
+// sizeof keeps probe-only values "used" without evaluating them 
+#define FS_PROBE0(name)          ((void)0)
+#define FS_PROBE1(name, a)       ((void)sizeof(a))
+#define FS_PROBE2(name, a, b)    ((void)sizeof(a), (void)sizeof(b))
+#define FS_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
 // ---------------- Globals ---------------- 
 
 extern SuperBlock sb;
 extern Inode inode_table[MAX_INODES];
 extern u8 block_bitmap[TOTAL_BLOCKS/8 + 1];
 extern int disk_fd;
+extern u32 inode_gen[MAX_INODES]; // bumped whenever an inode's block pointers change
+extern u32 inode_epoch[MAX_INODES]; // bumped when an inode is freed, tells a reused slot apart
+extern u8 block_refs[TOTAL_BLOCKS]; // extra owners of a data block, 0 = not shared 
 
 // ---------------- Bitmap Helpers ---------------- 
 
@@ -108,25 +153,43 @@ static inline void clear_bitmap(int idx) {
 static inline int test_bitmap(int idx) {
     return (block_bitmap[idx/8] >> (idx % 8)) & 1;
 }
+static inline void touch_inode(u32 ino) {
+    inode_gen[ino]++;
+}
 
 // ---------------- functions ---------------- 
 
+#define FORMAT_LAZY_ITABLE 0x1 // write only the root's inode block, the rest stays sparse 
+
 int format_fs(void);        // create & format virtual disk file 
+int format_fs_opts(u32 opts); // same with FORMAT_* options 
 int load_fs(void);          // load metadata into memory 
+int unload_fs(void);        // flush metadata, mark the image clean and close it 
 int sync_metadata(void);    // write metadata back to disk 
+int fs_defer_sync(int on);  // batch mode: hold metadata writes until fs_commit 
+int fs_commit(void);        // write metadata if anything changed since the last sync 
 
 // allocation helpers 
 int allocate_inode(void);
 int free_inode(u32 ino);
+int free_inodes(const u32 *inos, usize n);
 u32 allocate_block(void);
+u32 allocate_run(u32 count);
+void free_block(u32 block_idx);
+int share_block(u32 block_idx);
+int block_shared(u32 block_idx);
+void fs_counters(u32 *free_blocks, u32 *free_inodes);
 
 // low-level block read/write 
 ssize read_block(u32 block_idx, void *buf);
 ssize write_block(u32 block_idx, const void *buf);
+ssize read_blocks(u32 block_idx, u32 count, void *buf); // uncached, for runs of blocks
+ssize write_blocks(u32 block_idx, u32 count, const void *buf);
 
 // debug 
 void fs_info(void);
 DirEntry* read_dir_entries(Inode *dir, usize *out_count);
+ssize read_dir_entries_into(Inode *dir, DirEntry **buf, usize *cap);
 int write_dir_entries(Inode *dir, DirEntry *entries, usize count);
 u32 dir_lookup(Inode *dir, const char *name);
 int dir_add_entry(Inode *dir, const char *name, u32 inode_id);
@@ -143,10 +206,167 @@ int fs_rename(const char *oldpath, const char *newpath);
 ssize fs_read_file(const char *path,u8 *buf,usize maxlen);
 ssize fs_write_file(const char *path,const u8 *buf,usize len);
 void fs_find_paths(const char *pattern);
+void fs_find_glob(const char *pattern);
+void fs_find_substring(const char *needle);
 //static void find_paths_recursive(u32 ino, const regex_t *preg);
-char* get_full_path(u32 ino);
-void fs_list_dir_recursive(u32 ino, int depth);
+int fs_list_tree(u32 ino, int long_fmt);
 int fs_delete_dir_recursive(const char *path);
 int delete_inode_recursive(u32 ino);
+int fs_clone_inode(u32 src_ino, const char *dst);
+int fs_clone_file(const char *src, const char *dst);
+int fs_truncate(u32 ino, u64 newsize);
+#define FS_FALLOC_KEEP_SIZE  0x01  // reserve blocks without changing the file size 
+#define FS_FALLOC_PUNCH_HOLE 0x02  // free the range, needs KEEP_SIZE 
+int fs_fallocate(u32 ino, int mode, u64 off, u64 len);
+
+// fuse_bridge.c ioctl: clone the open file to dst (path inside the mount) 
+typedef struct CloneReq {
+    char dst[256];
+} CloneReq;
+#define VDISK_IOC_CLONE _IOW('G', 1, CloneReq)
+
+// fhandle.c 
+// per-open state, the fuse bridge keeps one of these in fi->fh 
+typedef struct FileHandle {
+    u32 ino;                  // inode the handle was opened on 
+    u32 map[DIRECT_PTRS];     // cached copy of the inode block pointers 
+    u32 map_gen;              // inode_gen[ino] at the time map was copied 
+    u32 epoch;                // inode_epoch[ino] at open, the file is gone once it differs 
+    off_t next_off;           // offset just after the last read/write 
+    u32 seq_count;            // number of back to back sequential accesses 
+    u32 ra_window;            // current readahead window in blocks 
+    u32 ra_end;               // file block index readahead was issued up to 
+} FileHandle;
+
+FileHandle* fh_open(u32 ino);
+ssize fh_read(FileHandle *fh, u8 *buf, usize len, off_t off);   // -ESTALE once the inode was freed 
+ssize fh_write(FileHandle *fh, const u8 *buf, usize len, off_t off);
+int fh_flush(FileHandle *fh);
+void fh_close(FileHandle *fh);
+
+// hostio.c 
+// moving file data between the host and the image in bounded memory 
+#define HOSTIO_CHUNK (64 * 1024)
+
+ssize fs_import_fd(int fd, const char *dst);
+ssize fs_export_fd(const char *src, int fd);
+ssize fs_export_inode(u32 ino, int fd);
+ssize fs_read_inode_raw(u32 ino, u8 *buf, usize cap);
+int host_write_all(int fd, const u8 *buf, usize len);
+
+// hosttree.c 
+long fs_import_tree(const char *hostdir, const char *dst);
+long fs_export_tree(const char *src, const char *hostdir);
+long fs_export_tar(const char *src, int fd);
+
+// pathcache.c 
+#define FS_PATH_MAX (MAX_INODES * (MAX_FILENAME + 1) + 1) // deepest possible chain of full names 
+
+ssize fs_path_of(u32 ino, char *buf, usize cap);
+void path_cache_invalidate(void);
+
+// nameidx.c 
+#define NAME_INDEX_BUCKETS 512
+#define NAME_INDEX_BLOCKS ((NAME_INDEX_BUCKETS * (MAX_INODES / 8)) / BLOCK_SIZE)
+
+int nameidx_enabled(void);
+void nameidx_add(u32 ino);
+void nameidx_remove(u32 ino);
+int nameidx_candidates(const char *lit, usize len, u64 *out);
+int nameidx_rebuild(void);
+int nameidx_load(void);
+int nameidx_save(void);
+
+// stats.c 
+// latency histograms, one per core call and fuse hook 
+enum {
+    ST_RESOLVE_PATH, ST_SYNC_METADATA, ST_READ_BLOCK, ST_FSYNC,
+    ST_FUSE_GETATTR, ST_FUSE_READDIR, ST_FUSE_OPEN, ST_FUSE_READ, ST_FUSE_WRITE, ST_FUSE_FLUSH,
+    ST_FUSE_RELEASE, ST_FUSE_MKDIR, ST_FUSE_CREATE, ST_FUSE_UNLINK, ST_FUSE_RMDIR, ST_FUSE_RENAME,
+    ST_FUSE_UTIMENS, ST_FUSE_STATFS, ST_FUSE_IOCTL, ST_FUSE_TRUNCATE, ST_FUSE_FTRUNCATE, ST_FUSE_FALLOCATE,
+    ST_COUNT
+};
+#define STATS_FILE "/.fsstats" // hidden file in the mount, read for a snapshot, write to reset 
+
+u64 stats_now(void);
+void stats_record(int op, u64 start_ns);
+usize stats_format(char *buf, usize cap);
+void stats_reset(void);
+const char* stats_op_name(int op);
+
+// ioacct.c 
+// categories for disk i/o, metadata is told apart by offset, data blocks by caller hint 
+enum { IO_CAT_SUPER, IO_CAT_INODES, IO_CAT_BITMAP, IO_CAT_INDEX, IO_CAT_DIR, IO_CAT_DATA, IO_CAT_COUNT };
+
+void io_account(int is_write, off_t off, usize asked, ssize got);
+void io_account_fsync(void);
+int io_set_category(int cat); // hint for data block i/o on this thread, returns the old one 
+usize io_format(char *buf, usize cap);
+void io_reset(void);
+void io_thread_totals(u64 *ios, u64 *fsyncs); // everything the calling thread issued so far 
+
+// slowlog.c 
+#define SLOWLOG_DEFAULT_MS 100
+
+int slowlog_open(const char *host_path, u64 threshold_ms);
+int slowlog_start(void);      // flusher thread, call after any daemonizing fork 
+void slowlog_close(void);
+u64 slowlog_threshold(void);
+void slowlog_record(const char *op, const char *path, long ino, u64 ns, u64 ios, u64 fsyncs);
+
+// trace.c 
+// op codes are stored in trace files, only ever append to this list 
+enum {
+    TR_GETATTR = 1, TR_READDIR, TR_OPEN, TR_READ, TR_WRITE, TR_FLUSH, TR_RELEASE, TR_MKDIR,
+    TR_CREATE, TR_UNLINK, TR_RMDIR, TR_RENAME, TR_UTIMENS, TR_STATFS, TR_CLONE, TR_TRUNCATE,
+    TR_FTRUNCATE, TR_FALLOCATE,
+    TR_BLOCK_READ, TR_BLOCK_WRITE, // read_block/write_block, off is the block number 
+    TR_OP_END
+};
+#define TRACE_MAX_PATH 4096
+#define TRACE_NO_INO 0xffffffffu
+
+typedef struct TraceRec {
+    u64 ts_ns;      // operation start, relative to the start of the trace 
+    u64 off;        // offset for read/write/fallocate 
+    u64 len;        // length, or the new size for truncate 
+    int32_t result; // what the operation returned 
+    u32 ino;        // inode of the open file, TRACE_NO_INO for path only ops 
+    u16 op;         // TR_* 
+    u16 mode;       // fallocate mode 
+    u16 path_len;   // path bytes follow the record, not nul terminated 
+    u16 path2_len;  // then the rename target or clone destination 
+} TraceRec;
+
+_Static_assert(sizeof(TraceRec) == 40, "TraceRec is an on-disk format");
+
+int trace_open(const char *host_path);
+void trace_close(void);
+int trace_enabled(void);
+void trace_record(u16 op, u64 start_ns, const char *path, const char *path2,
+                  u32 ino, u64 off, u64 len, u32 mode, int result);
+void trace_set_blocks(int on); // also record every read_block/write_block 
+void trace_block(u16 op, u32 block_idx);
+FILE* trace_read_open(const char *host_path);
+int trace_next(FILE *f, TraceRec *r, char *path, char *path2);
+
+// bcache.c 
+// write-through cache of data blocks in front of read_block/write_block 
+#define BCACHE_SLOTS 512
+
+int bcache_get(u32 block_idx, void *buf);
+void bcache_put(u32 block_idx, const void *buf);
+u32 bcache_write_gen(u32 block_idx);
+int bcache_fill(u32 block_idx, const void *buf, u32 gen);
+int bcache_contains(u32 block_idx);
+void bcache_drop(u32 block_idx);
+void bcache_reset(void);
+
+// readahead.c 
+#define RA_MIN_WINDOW 2            // blocks prefetched on the first sequential hit 
+#define RA_MAX_WINDOW DIRECT_PTRS  // window cap, a file never has more blocks 
+
+void ra_submit(const u32 *blocks, u32 count);
+void ra_on_read(FileHandle *fh);
 
 #endif 